@@ -0,0 +1,737 @@
+/* Content digests, computed by background threads and cached by inode. A
+ * request only ever sees a digest that is already known; a miss queues the
+ * file and the response goes out without one. The same threads compute block
+ * manifests for delta sync clients, which are kept in memory up to a
+ * budget. */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* O_NOATIME */
+#endif
+
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define SLOTS		4096
+#define WAYS		4	/* slots per set, least recently used replaced */
+#define QUEUE_LEN	64
+#define READ_LEN	(64 << 10)
+
+#define XATTR		"user.filesrv.sha256"
+
+#define MSLOTS		1024
+#define MANIFEST_MEM	(64 << 20)	/* bytes of manifests kept */
+#define BLOCK_MIN	(64 << 10)
+#define BLOCKS_MAX	65536		/* per manifest, by growing blocks */
+#define LINE_LEN	(8 + 1 + 2 * SHA256_LEN + 1)
+
+#ifndef O_NOATIME
+#define O_NOATIME	0
+#endif
+
+/* Identifies file contents well enough that a match means the digest holds. */
+struct key {
+	dev_t	 dev;
+	ino_t	 ino;
+	off_t	 size;
+	time_t	 sec;
+	long	 nsec;
+};
+
+struct slot {
+	struct key key;
+	int	 state;
+	uint64_t used;
+	uint8_t	 md[SHA256_LEN];
+};
+
+struct mslot {
+	struct key key;
+	int	 state;
+	struct manifest *m;
+	uint64_t used;
+};
+
+struct job {
+	struct key key;
+	int	 blocks;	/* a manifest rather than a digest */
+	char	 path[PATH_MAX];
+};
+
+enum {
+	EMPTY,
+	PENDING,
+	READY
+};
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	cond = PTHREAD_COND_INITIALIZER;
+static struct slot	slots[SLOTS];
+static struct mslot	mslots[MSLOTS];
+static size_t		mem;	/* in manifests, for the budget */
+static uint64_t		tick;
+static struct job	queue[QUEUE_LEN];
+static size_t		qhead, qlen;
+static int		persist;
+static int		running;
+
+static void *	worker(void *);
+static int	hash(struct job *, uint8_t *);
+static struct manifest *manifest(struct job *);
+static void	weak(const uint8_t *, size_t, uint32_t *, uint32_t *);
+static struct mslot *mfind(const struct key *);
+static struct mslot *mvictim(void);
+static void	keep(struct mslot *, struct manifest *);
+static void	release(struct manifest *);
+static int	openjob(struct job *);
+static char *	hex(char *, const uint8_t *, size_t);
+static struct slot *find(const struct key *);
+static struct slot *victim(const struct key *);
+static void	mkkey(struct key *, const struct stat *);
+static size_t	idx(const struct key *);
+static size_t	b64(char *, const uint8_t *, size_t);
+
+void
+digestinit(int nthreads, int xattr)
+{
+	pthread_t t;
+	int i;
+
+	persist = xattr;
+
+	for (i = 0; i < nthreads; i++) {
+		if ((errno = pthread_create(&t, NULL, worker, NULL)) != 0) {
+			err(1, "pthread_create");
+		}
+
+		(void)pthread_detach(t);
+	}
+
+	running = nthreads > 0;
+}
+
+/* Write ETag and Repr-Digest header lines for the file into buf if its digest
+ * is known, otherwise queue it. Returns the length written, 0 if none. Never
+ * blocks: if the table is busy the digest is simply left out. */
+size_t
+digesthdr(const struct stat *st, const char *path, char *buf, size_t len)
+{
+	struct key key;
+	struct slot *s;
+	struct job *j;
+	uint8_t md[SHA256_LEN];
+
+	if (!running || pthread_mutex_trylock(&lock) != 0) {
+		return 0;
+	}
+
+	mkkey(&key, st);
+
+	if ((s = find(&key)) != NULL && s->state == READY) {
+		s->used = ++tick;
+		(void)memcpy(md, s->md, SHA256_LEN);
+		(void)pthread_mutex_unlock(&lock);
+	} else {
+		/* Digests being computed are never replaced, so a full set of
+		 * them just leaves this one for later. */
+		if ((s == NULL || s->state == EMPTY) && qlen < QUEUE_LEN
+			&& strlen(path) < PATH_MAX
+			&& (s != NULL || (s = victim(&key)) != NULL)) {
+			s->key = key;
+			s->state = PENDING;
+			s->used = ++tick;
+
+			j = &queue[(qhead + qlen++) % QUEUE_LEN];
+			j->key = key;
+			j->blocks = 0;
+			(void)memcpy(j->path, path, strlen(path) + 1);
+			(void)pthread_cond_signal(&cond);
+		}
+
+		(void)pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	return digestfmt(md, buf, len);
+}
+
+/* Find the block manifest of the file. Returns 0 with a reference to it in
+ * *m, to be dropped with digestrelease(), 1 if it isn't known yet, in which
+ * case it is queued, or -1 if there are no threads to compute it. Never
+ * blocks. */
+int
+digestblocks(const struct stat *st, const char *path, struct manifest **m)
+{
+	struct mslot *s;
+	struct key key;
+	struct job *j;
+
+	if (!running) {
+		return -1;
+	}
+
+	if (pthread_mutex_trylock(&lock) != 0) {
+		return 1;
+	}
+
+	mkkey(&key, st);
+
+	if ((s = mfind(&key)) != NULL && s->state == READY) {
+		s->m->refs++;
+		s->used = ++tick;
+		*m = s->m;
+		(void)pthread_mutex_unlock(&lock);
+		return 0;
+	}
+
+	/* Manifests being computed are never replaced; with every slot
+	 * pending, this one waits for a retry. */
+	if ((s == NULL || s->state == EMPTY) && qlen < QUEUE_LEN
+		&& strlen(path) < PATH_MAX
+		&& (s != NULL || (s = mvictim()) != NULL)) {
+		keep(s, NULL);
+		s->key = key;
+		s->state = PENDING;
+		s->used = ++tick;
+
+		j = &queue[(qhead + qlen++) % QUEUE_LEN];
+		j->key = key;
+		j->blocks = 1;
+		(void)memcpy(j->path, path, strlen(path) + 1);
+		(void)pthread_cond_signal(&cond);
+	}
+
+	(void)pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+/* Drop a reference from digestblocks(). Not to be called in a child forked
+ * while other threads may hold the lock. */
+void
+digestrelease(struct manifest *m)
+{
+	(void)pthread_mutex_lock(&lock);
+	release(m);
+	(void)pthread_mutex_unlock(&lock);
+}
+
+/* Write the header lines for digest md into buf. Returns the length written,
+ * 0 if it doesn't fit. */
+size_t
+digestfmt(const uint8_t *md, char *buf, size_t len)
+{
+	char hex[2 * SHA256_LEN + 1];
+	char b[64];
+	int i, n;
+
+	for (i = 0; i < SHA256_LEN; i++) {
+		hex[2*i] = "0123456789abcdef"[md[i] >> 4];
+		hex[2*i + 1] = "0123456789abcdef"[md[i] & 0xf];
+	}
+	hex[2 * SHA256_LEN] = '\0';
+
+	(void)b64(b, md, SHA256_LEN);
+
+	n = snprintf(buf, len, "ETag: \"%s\"\r\n"
+		"Repr-Digest: sha-256=:%s:\r\n", hex, b);
+
+	if (n < 0 || (size_t)n >= len) {
+		return 0;
+	}
+
+	return (size_t)n;
+}
+
+static void *
+worker(void *arg)
+{
+	struct job j;
+	struct slot *s;
+	struct mslot *ms;
+	struct manifest *m;
+	uint8_t md[SHA256_LEN];
+	int ok;
+
+	(void)arg;
+
+	while (1) {
+		(void)pthread_mutex_lock(&lock);
+
+		while (qlen == 0) {
+			(void)pthread_cond_wait(&cond, &lock);
+		}
+
+		j = queue[qhead];
+		qhead = (qhead + 1) % QUEUE_LEN;
+		qlen--;
+
+		(void)pthread_mutex_unlock(&lock);
+
+		if (j.blocks) {
+			m = manifest(&j);
+
+			(void)pthread_mutex_lock(&lock);
+
+			if ((ms = mfind(&j.key)) != NULL
+				&& ms->state == PENDING) {
+				ms->state = m != NULL ? READY : EMPTY;
+				keep(ms, m);
+			} else if (m != NULL) {
+				release(m);
+			}
+
+			(void)pthread_mutex_unlock(&lock);
+			continue;
+		}
+
+		ok = hash(&j, md) == 0;
+
+		(void)pthread_mutex_lock(&lock);
+
+		if ((s = find(&j.key)) != NULL && s->state == PENDING) {
+			s->state = ok ? READY : EMPTY;
+			(void)memcpy(s->md, md, SHA256_LEN);
+		}
+
+		(void)pthread_mutex_unlock(&lock);
+	}
+
+	return NULL;
+}
+
+/* Hash the file if it still matches the job's key, using the digest stored
+ * in its extended attribute when that was recorded for the same key. */
+static int
+hash(struct job *j, uint8_t *md)
+{
+	uint8_t buf[READ_LEN];
+	struct sha256 sha;
+	struct stat st;
+	struct key key;
+	ssize_t n;
+	int fd;
+	int rv;
+#ifdef __linux__
+	uint8_t x[sizeof(struct key) + SHA256_LEN];
+#endif
+
+	if ((fd = openjob(j)) == -1) {
+		return -1;
+	}
+
+	rv = -1;
+
+#ifdef __linux__
+	if (fgetxattr(fd, XATTR, x, sizeof(x)) == sizeof(x)
+		&& memcmp(x, &j->key, sizeof(j->key)) == 0) {
+		(void)memcpy(md, x + sizeof(key), SHA256_LEN);
+		rv = 0;
+		goto done;
+	}
+#endif
+
+	sha256_init(&sha);
+
+	while ((n = read(fd, buf, READ_LEN)) > 0) {
+		sha256_update(&sha, buf, (size_t)n);
+	}
+
+	if (n == -1) {
+		goto done;
+	}
+
+	sha256_final(&sha, md);
+
+	/* Don't publish a digest of contents that changed while reading. */
+	if (fstat(fd, &st) == -1) {
+		goto done;
+	}
+
+	mkkey(&key, &st);
+
+	if (memcmp(&key, &j->key, sizeof(key)) != 0) {
+		goto done;
+	}
+
+	rv = 0;
+
+#ifdef __linux__
+	if (persist) {
+		(void)memcpy(x, &key, sizeof(key));
+		(void)memcpy(x + sizeof(key), md, SHA256_LEN);
+
+		if (fsetxattr(fd, XATTR, x, sizeof(x), 0) == -1
+			&& errno != EACCES && errno != EPERM
+			&& errno != ENOTSUP) {
+			warn("fsetxattr %s", j->path);
+		}
+	}
+#endif
+
+done:
+	(void)close(fd);
+	return rv;
+}
+
+/* Compute the block manifest of the job's file if it still matches the job's
+ * key: its size and block size, then the rsync checksum and SHA-256 digest of
+ * each block, in hex, a line each. */
+static struct manifest *
+manifest(struct job *j)
+{
+	uint8_t buf[READ_LEN];
+	uint8_t md[SHA256_LEN];
+	uint8_t w[4];
+	struct manifest *m;
+	struct sha256 sha;
+	struct stat st;
+	struct key key;
+	uint32_t s1, s2;
+	off_t size, left;
+	size_t bsize, nblocks, cap, want;
+	ssize_t n;
+	char *p;
+	int fd;
+
+	if ((fd = openjob(j)) == -1) {
+		return NULL;
+	}
+
+	size = j->key.size;
+
+	for (bsize = BLOCK_MIN; (size_t)((size + (off_t)bsize - 1)
+		/ (off_t)bsize) > BLOCKS_MAX; bsize *= 2) {
+	}
+
+	nblocks = (size_t)((size + (off_t)bsize - 1) / (off_t)bsize);
+	cap = 64 + nblocks * LINE_LEN;
+
+	if ((m = malloc(sizeof(*m) + cap)) == NULL) {
+		warn("malloc");
+		(void)close(fd);
+		return NULL;
+	}
+
+	m->refs = 0;
+	p = m->text + snprintf(m->text, cap, "size %jd\nblock %zu\n",
+		(intmax_t)size, bsize);
+
+	for (; size > 0; size -= left) {
+		left = size < (off_t)bsize ? size : (off_t)bsize;
+
+		sha256_init(&sha);
+		s1 = 0;
+		s2 = 0;
+
+		for (want = (size_t)left; want > 0; want -= (size_t)n) {
+			if ((n = read(fd, buf, want < READ_LEN ? want
+				: READ_LEN)) <= 0) {
+				goto fail;
+			}
+
+			weak(buf, (size_t)n, &s1, &s2);
+			sha256_update(&sha, buf, (size_t)n);
+		}
+
+		sha256_final(&sha, md);
+
+		s1 = (s1 & 0xffff) | s2 << 16;
+		w[0] = (uint8_t)(s1 >> 24);
+		w[1] = (uint8_t)(s1 >> 16);
+		w[2] = (uint8_t)(s1 >> 8);
+		w[3] = (uint8_t)s1;
+
+		p = hex(p, w, sizeof(w));
+		*p++ = ' ';
+		p = hex(p, md, SHA256_LEN);
+		*p++ = '\n';
+	}
+
+	/* Don't publish a manifest of contents that changed while reading. */
+	if (fstat(fd, &st) == -1) {
+		goto fail;
+	}
+
+	mkkey(&key, &st);
+
+	if (memcmp(&key, &j->key, sizeof(key)) != 0) {
+		goto fail;
+	}
+
+	(void)close(fd);
+	m->len = (size_t)(p - m->text);
+	return m;
+
+fail:
+	(void)close(fd);
+	free(m);
+	return NULL;
+}
+
+/* Add n bytes to the rsync checksum s1, s2 of a block so far, as if each byte
+ * were added to s1 and s1 then to s2. Done in runs of fixed length, so
+ * compilers vectorize them. */
+static void
+weak(const uint8_t *p, size_t n, uint32_t *s1, uint32_t *s2)
+{
+	uint32_t a, b;
+	size_t i, run;
+
+	for (; n > 0; p += run, n -= run) {
+		run = n < 64 ? n : 64;
+		a = 0;
+		b = 0;
+
+		if (run == 64) {
+			for (i = 0; i < 64; i++) {
+				a += p[i];
+				b += (uint32_t)(64 - i) * p[i];
+			}
+		} else {
+			for (i = 0; i < run; i++) {
+				a += p[i];
+				b += (uint32_t)(run - i) * p[i];
+			}
+		}
+
+		*s2 += (uint32_t)run * *s1 + b;
+		*s1 += a;
+	}
+}
+
+/* The manifest slot for key, whatever its state, or NULL. */
+static struct mslot *
+mfind(const struct key *key)
+{
+	size_t i;
+
+	for (i = 0; i < MSLOTS; i++) {
+		if (memcmp(&mslots[i].key, key, sizeof(*key)) == 0) {
+			return &mslots[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* A manifest slot to take: an empty one, otherwise the least recently used
+ * ready one. NULL if all of them are pending. */
+static struct mslot *
+mvictim(void)
+{
+	struct mslot *s;
+	size_t i;
+
+	s = NULL;
+
+	for (i = 0; i < MSLOTS; i++) {
+		if (mslots[i].state == EMPTY) {
+			return &mslots[i];
+		} else if (mslots[i].state == READY
+			&& (s == NULL || mslots[i].used < s->used)) {
+			s = &mslots[i];
+		}
+	}
+
+	return s;
+}
+
+/* Put m, which may be NULL, in the slot, and keep the manifests within their
+ * budget by dropping the least recently used. */
+static void
+keep(struct mslot *s, struct manifest *m)
+{
+	struct mslot *old;
+	size_t i;
+
+	if (s->m != NULL) {
+		mem -= s->m->len;
+		release(s->m);
+	}
+
+	s->m = m;
+
+	if (m == NULL) {
+		return;
+	}
+
+	m->refs++;
+	mem += m->len;
+	s->used = ++tick;
+
+	while (mem > MANIFEST_MEM) {
+		old = NULL;
+
+		for (i = 0; i < MSLOTS; i++) {
+			if (&mslots[i] == s || mslots[i].m == NULL) {
+				continue;
+			}
+
+			if (old == NULL || mslots[i].used < old->used) {
+				old = &mslots[i];
+			}
+		}
+
+		if (old == NULL) {
+			break;
+		}
+
+		mem -= old->m->len;
+		release(old->m);
+		old->m = NULL;
+		old->state = EMPTY;
+	}
+}
+
+static void
+release(struct manifest *m)
+{
+	if (--m->refs == 0) {
+		free(m);
+	}
+}
+
+/* Open the job's file if it still matches the job's key. */
+static int
+openjob(struct job *j)
+{
+	struct stat st;
+	struct key key;
+	int fd;
+
+	if ((fd = open(j->path, O_RDONLY | O_NOFOLLOW | O_NOATIME)) == -1
+		&& (errno != EPERM
+		|| (fd = open(j->path, O_RDONLY | O_NOFOLLOW)) == -1)) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		(void)close(fd);
+		return -1;
+	}
+
+	mkkey(&key, &st);
+
+	if (memcmp(&key, &j->key, sizeof(key)) != 0) {
+		(void)close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static char *
+hex(char *out, const uint8_t *in, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*out++ = "0123456789abcdef"[in[i] >> 4];
+		*out++ = "0123456789abcdef"[in[i] & 0xf];
+	}
+
+	return out;
+}
+
+/* The slot for key in its set, whatever its state, or NULL. */
+static struct slot *
+find(const struct key *key)
+{
+	struct slot *set;
+	int i;
+
+	set = &slots[idx(key) % (SLOTS / WAYS) * WAYS];
+
+	for (i = 0; i < WAYS; i++) {
+		if (memcmp(&set[i].key, key, sizeof(*key)) == 0) {
+			return &set[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* A slot to take for key in its set: an empty one, otherwise the least
+ * recently used ready one. NULL if all of them are pending. */
+static struct slot *
+victim(const struct key *key)
+{
+	struct slot *set, *s;
+	int i;
+
+	set = &slots[idx(key) % (SLOTS / WAYS) * WAYS];
+	s = NULL;
+
+	for (i = 0; i < WAYS; i++) {
+		if (set[i].state == EMPTY) {
+			return &set[i];
+		} else if (set[i].state == READY
+			&& (s == NULL || set[i].used < s->used)) {
+			s = &set[i];
+		}
+	}
+
+	return s;
+}
+
+static void
+mkkey(struct key *key, const struct stat *st)
+{
+	/* Zeroed so padding compares equal. */
+	(void)memset(key, 0, sizeof(*key));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->sec = st->st_mtim.tv_sec;
+	key->nsec = st->st_mtim.tv_nsec;
+}
+
+static size_t
+idx(const struct key *key)
+{
+	uint64_t h;
+
+	h = (uint64_t)key->ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)key->dev;
+	return (size_t)(h >> 32) % SLOTS;
+}
+
+static size_t
+b64(char *out, const uint8_t *in, size_t len)
+{
+	static const char enc[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t v;
+	size_t i, n;
+
+	for (i = 0, n = 0; i < len; i += 3) {
+		v = (uint32_t)in[i] << 16;
+		if (i + 1 < len) {
+			v |= (uint32_t)in[i + 1] << 8;
+		}
+		if (i + 2 < len) {
+			v |= in[i + 2];
+		}
+
+		out[n++] = enc[v >> 18 & 63];
+		out[n++] = enc[v >> 12 & 63];
+		out[n++] = i + 1 < len ? enc[v >> 6 & 63] : '=';
+		out[n++] = i + 2 < len ? enc[v & 63] : '=';
+	}
+
+	out[n] = '\0';
+	return n;
+}
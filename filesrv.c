@@ -22,13 +22,17 @@
 
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <err.h>
 #include <errno.h>
 #include <grp.h>
 #include <limits.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdint.h>
@@ -40,30 +44,70 @@
 #include "filesrv.h"
 
 #define PORT_DEFAULT	8080
-#define Q_LEN		20
+#define Q_DEFAULT	20
+#define BULK_DEFAULT	(1 << 20)
 #define T_DEFAULT	3
-#define USAGE		"usage: %s [-d] [-p port] [-t timeout] [-u user] dir\n"
+#define CRAWL_DEFAULT	8
+#define NEG_DEFAULT	4096
+#define OFFLOAD_DEFAULT	100
+#define USAGE		"usage: %s [-dfx] [-b backlog] [-c maxconn] " \
+			"[-e evictsize] [-F nfollow] [-H nhash] [-i index] " \
+			"[-j ncrawl] [-k prefix:pack] [-L budget] " \
+			"[-l [prefix:]rate] [-m minrate] [-N nneg] [-n nbulk] " \
+			"[-o nthreads[:ms]] [-P [seconds:]file] [-p port] " \
+			"[-R trace] [-r path] [-S ms] [-s bulksize] " \
+			"[-t timeout] [-u user] [-v fallback] [-W [n:]list] " \
+			"[-w workers] dir\n"
 
 static uint16_t	assigned_port(int);
-static void	mkdaemon(int);
+static int	listener(uint16_t, int);
+static pid_t	child(struct srv *);
+static void	reap(struct srv *);
+static int	qdepth(int);
+static void	addlimit(struct srv *, char *);
+static unsigned long	num(const char *, const char *, unsigned long);
+static void	mkdaemon(const int *, size_t);
+static int	takeover(const char *);
+static int	ctlsocket(const char *);
+static void	handoff(int, int);
+static void	unaddr(struct sockaddr_un *, const char *);
 
 int
 main(int argc, char *argv[])
 {
 	char dir[PATH_MAX];
 	struct sockaddr_in addr;
+	struct pollfd pfd[2];
 	struct sigaction act;
 	struct timeval tv;
 	struct passwd *pw;
-	size_t dirlen;
+	struct srv srv;
 	socklen_t addrlen;
 	unsigned long n;
-	int afd, sfd;
+	size_t lockbudget;
+	size_t nneg;
+	int afd, cfd, sfd;
+	int *keep, *lfds;
+	size_t nkeep;
+	int backlog;
 	int ch;
 	int daemonize;
-	int opt;
+	int fastopen;
+	int i;
+	int maxconn;
+	int ncrawl;
+	int nlfd;
+	int noffload;
+	int nworkers;
+	int offloadms;
+	char *ctl;
 	char *end;
+	char *idxfile;
+	char *prof;
+	char *tracefile;
 	char *user;
+	char *fallback;
+	char *warmfile;
 	uint16_t port;
 
 	tv.tv_sec = T_DEFAULT;
@@ -71,20 +115,96 @@ main(int argc, char *argv[])
 
 	addrlen = sizeof(addr);
 
+	(void)memset(&srv, 0, sizeof(srv));
+	srv.bulksize = BULK_DEFAULT;
+
 	sfd = -1;
 	afd = -1;
+	cfd = -1;
+	nkeep = 0;
 
-	opt = 1;
-
+	backlog = Q_DEFAULT;
 	daemonize = 0;
+	fastopen = 0;
+	maxconn = 0;
+	ncrawl = CRAWL_DEFAULT;
+	nneg = NEG_DEFAULT;
+	noffload = 0;
+	offloadms = OFFLOAD_DEFAULT;
+	nworkers = 0;
+	idxfile = NULL;
+	prof = NULL;
+	tracefile = NULL;
+	ctl = NULL;
 	user = NULL;
+	fallback = NULL;
+	warmfile = NULL;
+	lockbudget = 0;
 	port = PORT_DEFAULT;
 
-	while ((ch = getopt(argc, argv, "dp:t:u:")) != -1) {
+	while ((ch = getopt(argc, argv,
+		"b:c:de:F:fH:i:j:k:L:l:m:N:n:o:P:p:R:r:S:s:t:u:v:W:w:x")) != -1) {
 		switch (ch) {
+		case 'b':
+			backlog = (int)num(optarg, "backlog", INT_MAX);
+			break;
+		case 'c':
+			maxconn = (int)num(optarg, "maxconn", INT_MAX);
+			break;
 		case 'd':
 			daemonize = 1;
 			break;
+		case 'e':
+			srv.evictsize = (off_t)num(optarg, "evictsize", LONG_MAX);
+			break;
+		case 'F':
+			srv.maxfollow = (int)num(optarg, "nfollow", 1 << 16);
+			break;
+		case 'f':
+			fastopen = 1;
+			break;
+		case 'H':
+			srv.nhash = (int)num(optarg, "nhash", 64);
+			break;
+		case 'i':
+			idxfile = optarg;
+			break;
+		case 'j':
+			ncrawl = (int)num(optarg, "ncrawl", 256);
+			break;
+		case 'k':
+			packmount(optarg);
+			break;
+		case 'L':
+			lockbudget = (size_t)num(optarg, "budget", LONG_MAX);
+			break;
+		case 'l':
+			addlimit(&srv, optarg);
+			break;
+		case 'm':
+			srv.minrate = (size_t)num(optarg, "minrate", SIZE_MAX);
+			break;
+		case 'N':
+			nneg = (size_t)num(optarg, "nneg", 1 << 20);
+			break;
+		case 'n':
+			srv.maxbulk = (int)num(optarg, "nbulk", INT_MAX);
+			break;
+		case 'o':
+			if ((end = strchr(optarg, ':')) != NULL) {
+				*end++ = '\0';
+
+				if ((offloadms = (int)num(end, "ms", INT_MAX))
+					== 0) {
+					errx(1, "ms must be positive");
+				}
+			}
+
+			noffload = (int)num(optarg, "nthreads", 64);
+			break;
+		case 'P':
+			prof = optarg;
+			break;
 		case 'p':
 			n = strtoul(optarg, &end, 0);
 
@@ -98,6 +218,18 @@ main(int argc, char *argv[])
 
 			port = (uint16_t)n;
 			break;
+		case 'R':
+			tracefile = optarg;
+			break;
+		case 'r':
+			ctl = optarg;
+			break;
+		case 'S':
+			srv.slow = num(optarg, "slow", UINT32_MAX);
+			break;
+		case 's':
+			srv.bulksize = (off_t)num(optarg, "bulksize", LONG_MAX);
+			break;
 		case 't':
 			tv.tv_sec = (time_t)strtoul(optarg, &end, 0);
 
@@ -111,6 +243,18 @@ main(int argc, char *argv[])
 		case 'u':
 			user = optarg;
 			break;
+		case 'v':
+			fallback = optarg;
+			break;
+		case 'W':
+			warmfile = optarg;
+			break;
+		case 'w':
+			nworkers = (int)num(optarg, "workers", 1024);
+			break;
+		case 'x':
+			srv.xattr = 1;
+			break;
 		default:
 			(void)fprintf(stderr, USAGE, argv[0]);
 			return 1;
@@ -127,6 +271,53 @@ main(int argc, char *argv[])
 
 	argv += optind;
 
+	/* The successor would only get one of the workers' sockets. */
+	if (ctl != NULL && nworkers > 0) {
+		errx(1, "-r and -w are mutually exclusive");
+	}
+
+	if (lockbudget != 0 && warmfile == NULL) {
+		errx(1, "-L needs -W");
+	}
+
+	nlfd = nworkers > 0 ? nworkers : 1;
+
+	if ((lfds = calloc((size_t)nlfd, sizeof(*lfds))) == NULL
+		|| (keep = calloc((size_t)nlfd + 4, sizeof(*keep))) == NULL
+		|| (srv.fpid = calloc((size_t)srv.maxfollow + 1,
+		sizeof(*srv.fpid))) == NULL) {
+		err(1, "calloc");
+	}
+
+	/* Handoff sockets live outside the served directory. */
+	if (ctl != NULL) {
+		sfd = takeover(ctl);
+		cfd = ctlsocket(ctl);
+	}
+
+	/* So are the index, profile, trace and hot set; packs are mapped as
+	 * they are parsed. */
+	if (idxfile != NULL) {
+		keep[nkeep++] = indexopen(idxfile);
+	}
+
+	if (prof != NULL) {
+		keep[nkeep++] = profinit(prof);
+	}
+
+	if (tracefile != NULL) {
+		keep[nkeep++] = traceopen(tracefile);
+		srv.trace = 1;
+	}
+
+	if (warmfile != NULL) {
+		warminit(warmfile, lockbudget);
+	}
+
+	if (nworkers > 0) {
+		workerinit();
+	}
+
 	if (getuid() == 0) {
 		if (user != NULL) {
 			if ((pw = getpwnam(user)) == NULL) {
@@ -156,7 +347,21 @@ main(int argc, char *argv[])
 		err(1, "getcwd");
 	}
 
-	dirlen = strnlen(dir, PATH_MAX);
+	srv.dir = dir;
+	srv.dirlen = strnlen(dir, PATH_MAX);
+	srv.timeout = tv.tv_sec;
+
+	if (fallback != NULL) {
+		vhostinit(dir, fallback);
+		srv.vhost = 1;
+	}
+
+	indexinit(dir, ncrawl, nneg);
+
+	/* Transfers only overlap in bulk children and workers. */
+	if (srv.maxbulk != 0 || nworkers > 0) {
+		flightinit();
+	}
 
 	(void)memset(&act, 0, sizeof(act));
 
@@ -170,30 +375,34 @@ main(int argc, char *argv[])
 		err(1, "sigaction SIGPIPE");
 	}
 
-	if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		err(1, "socket");
+	if (sfd == -1) {
+		sfd = listener(port, nworkers > 0);
 	}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-		err(1, "setsockopt SO_REUSEADDR");
+	/* One socket per worker, on the port the first one got. */
+	lfds[0] = sfd;
+	for (i = 1; i < nlfd; i++) {
+		lfds[i] = listener(assigned_port(sfd), 1);
 	}
 
-	(void)memset(&addr, 0, sizeof(addr));
-
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = INADDR_ANY;
-	addr.sin_port = htons(port);
-
-	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
-		err(1, "bind");
-	}
-
-	if (port == 0) {
-		(void)printf("assigned port %u\n", assigned_port(sfd));
-	}
+	for (i = 0; i < nlfd; i++) {
+		if (fastopen) {
+#ifdef TCP_FASTOPEN
+			if (setsockopt(lfds[i], IPPROTO_TCP, TCP_FASTOPEN,
+				&backlog, sizeof(backlog)) == -1) {
+				warn("setsockopt TCP_FASTOPEN");
+			}
+#else
+			warnx("TCP_FASTOPEN not supported");
+#endif
+		}
 
-	if (listen(sfd, Q_LEN) == -1) {
-		err(1, "listen");
+		/* Also resizes the queue of a socket taken over with -r.
+		 * Listening in order numbers the workers' sockets in their
+		 * SO_REUSEPORT group. */
+		if (listen(lfds[i], backlog) == -1) {
+			err(1, "listen");
+		}
 	}
 
 	/* Drop privileges. */
@@ -218,21 +427,90 @@ main(int argc, char *argv[])
 #endif
 
 	if (daemonize == 1) {
-		mkdaemon(sfd);
+		for (i = 0; i < nlfd; i++) {
+			keep[nkeep++] = lfds[i];
+		}
+		keep[nkeep++] = cfd;
+		mkdaemon(keep, nkeep);
+	}
+
+	/* In the parent of any workers, which outlives them, so locked files
+	 * stay locked. */
+	warmstart(dir, srv.vhost);
+
+	if (nworkers > 0) {
+		/* Only returns in a worker, with its socket. */
+		sfd = workers(lfds, nworkers);
+	}
+
+	/* Before any threads, which inherit their signal masks. Workers log
+	 * the pool along with their own counters. */
+	profstart();
+	offloadinit(noffload, offloadms, nworkers == 0);
+
+	/* With workers, the parent keeps the index. */
+	if (nworkers == 0) {
+		indexwatch();
 	}
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath inet", "") == -1) {
+	if (pledge(cfd == -1 ? "stdio rpath inet proc"
+		: "stdio rpath inet proc unix sendfd", "") == -1) {
 		err(1, "pledge");
 	}
 #endif
 
+	srv.lfd[0] = sfd;
+	srv.lfd[1] = cfd;
+
+	/* After daemonizing, since threads don't survive fork. */
+	digestinit(srv.nhash, srv.xattr);
+
+	pfd[0].fd = sfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = cfd;
+	pfd[1].events = POLLIN;
+
 	while (1) {
+		if (cfd != -1) {
+			if (poll(pfd, 2, -1) == -1) {
+				if (errno != EINTR) {
+					warn("poll");
+				}
+				continue;
+			}
+
+			if (pfd[1].revents & POLLIN) {
+				/* Successor takes the listening socket; the
+				 * accept queue carries over untouched. */
+				handoff(cfd, sfd);
+				continue;
+			}
+
+			if ((pfd[0].revents & POLLIN) == 0) {
+				continue;
+			}
+		}
+
 		if ((afd = accept(sfd, (struct sockaddr *)&addr, &addrlen)) == -1) {
-			warn("accept");
+			if (errno != EINTR) {
+				warn("accept");
+			}
 			continue;
 		}
 
+		workerconn(afd);
+
+		reap(&srv);
+
+		/* Everything still queued behind this connection counts
+		 * towards the limit, since it is served one at a time. */
+		if (maxconn != 0 && qdepth(sfd) + srv.nbulk + srv.nfollow
+			>= maxconn) {
+			shed(afd);
+			goto done;
+		}
+
 		if (setsockopt(afd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
 			warn("setsockopt SO_RCVTIMEO");
 			goto done;
@@ -243,7 +521,11 @@ main(int argc, char *argv[])
 			goto done;
 		}
 
-		respond(afd, dir, dirlen);
+		if (respond(afd, &srv) == 1) {
+			/* A bulk child owns the connection now. */
+			goto done;
+		}
+
 		errno = 0;
 
 		if (shutdown(afd, SHUT_RDWR) == -1 && errno != ENOTCONN) {
@@ -257,6 +539,196 @@ done:
 	}
 }
 
+static int
+listener(uint16_t port, int reuseport)
+{
+	struct sockaddr_in addr;
+	int opt;
+	int sfd;
+
+	opt = 1;
+
+	if ((sfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		err(1, "socket");
+	}
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+		err(1, "setsockopt SO_REUSEADDR");
+	}
+
+	if (reuseport && setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &opt,
+		sizeof(opt)) == -1) {
+		err(1, "setsockopt SO_REUSEPORT");
+	}
+
+	(void)memset(&addr, 0, sizeof(addr));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+
+	if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err(1, "bind");
+	}
+
+	if (port == 0) {
+		(void)printf("assigned port %u\n", assigned_port(sfd));
+	}
+
+	return sfd;
+}
+
+/* Fork a child to finish the current connection, or return -1 if the
+ * limit is reached or fork fails. */
+pid_t
+bulk(struct srv *srv)
+{
+	pid_t p;
+
+	if (srv->nbulk >= srv->maxbulk) {
+		return -1;
+	}
+
+	if ((p = child(srv)) > 0) {
+		srv->nbulk++;
+	}
+
+	return p;
+}
+
+/* Fork a child to follow a file on the current connection, or return -1 if
+ * the limit is reached or fork fails. */
+pid_t
+follower(struct srv *srv)
+{
+	pid_t p;
+	int i;
+
+	if (srv->nfollow >= srv->maxfollow) {
+		return -1;
+	}
+
+	if ((p = child(srv)) > 0) {
+		for (i = 0; srv->fpid[i] != 0; i++) {
+		}
+
+		srv->fpid[i] = p;
+		srv->nfollow++;
+	}
+
+	return p;
+}
+
+static pid_t
+child(struct srv *srv)
+{
+	pid_t p;
+
+	if ((p = fork()) == -1) {
+		warn("fork");
+		return -1;
+	} else if (p > 0) {
+		return p;
+	}
+
+	if (close(srv->lfd[0]) == -1
+		|| (srv->lfd[1] != -1 && close(srv->lfd[1]) == -1)) {
+		warn("close listener");
+	}
+
+	return 0;
+}
+
+/* Collect bulk children and followers that are done. */
+static void
+reap(struct srv *srv)
+{
+	pid_t p;
+	int i;
+
+	while (srv->nbulk + srv->nfollow > 0
+		&& (p = waitpid(-1, NULL, WNOHANG)) > 0) {
+		for (i = 0; i < srv->maxfollow && srv->fpid[i] != p; i++) {
+		}
+
+		if (i < srv->maxfollow) {
+			srv->fpid[i] = 0;
+			srv->nfollow--;
+		} else {
+			srv->nbulk--;
+		}
+	}
+}
+
+/* Connections waiting in the accept queue, or 0 if unknown. */
+static int
+qdepth(int sfd)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	/* For listening sockets Linux reports the accept queue length in
+	 * tcpi_unacked. */
+	if (getsockopt(sfd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1) {
+		return 0;
+	}
+
+	return (int)ti.tcpi_unacked;
+#else
+	(void)sfd;
+	return 0;
+#endif
+}
+
+/* Parse [prefix:]rate; without a prefix the limit applies to every file. */
+static void
+addlimit(struct srv *srv, char *arg)
+{
+	struct limit *l;
+	char *rate;
+
+	if (srv->nlimits == LIMIT_MAX) {
+		errx(1, "too many rate limits");
+	}
+
+	l = &srv->limits[srv->nlimits++];
+
+	if ((rate = strrchr(arg, ':')) == NULL) {
+		l->prefix = "";
+		rate = arg;
+	} else {
+		*rate++ = '\0';
+		l->prefix = arg;
+	}
+
+	l->len = strlen(l->prefix);
+
+	if ((l->rate = (size_t)num(rate, "rate", SIZE_MAX)) == 0) {
+		errx(1, "rate must be positive");
+	}
+}
+
+static unsigned long
+num(const char *s, const char *name, unsigned long max)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(s, &end, 0);
+
+	if (errno == EINVAL || errno == ERANGE) {
+		err(1, "%s string invalid", name);
+	} else if (s == end || *end != '\0') {
+		errx(1, "%s string invalid", name);
+	} else if (n > max) {
+		errx(1, "%s '%lu' too large", name, n);
+	}
+
+	return n;
+}
+
 static uint16_t
 assigned_port(int fd)
 {
@@ -271,8 +743,9 @@ assigned_port(int fd)
 }
 
 static void
-mkdaemon(int sfd)
+mkdaemon(const int *keep, size_t nkeep)
 {
+	size_t j;
 	long i;
 	pid_t p;
 
@@ -307,7 +780,10 @@ mkdaemon(int sfd)
 	}
 
 	for (; i >= 0; --i) {
-		if (i != sfd && close((int)i) == -1 && errno != EBADF
+		for (j = 0; j < nkeep && keep[j] != i; j++) {
+		}
+
+		if (j == nkeep && close((int)i) == -1 && errno != EBADF
 			&& i >= STDERR_FILENO) {
 			warn("closing fd %ld failed", i);
 		}
@@ -315,3 +791,146 @@ mkdaemon(int sfd)
 
 	errno = 0;
 }
+
+static void
+unaddr(struct sockaddr_un *un, const char *path)
+{
+	(void)memset(un, 0, sizeof(*un));
+	un->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(un->sun_path)) {
+		errx(1, "handoff path too long");
+	}
+
+	(void)memcpy(un->sun_path, path, strlen(path) + 1);
+}
+
+/* Receive the listening socket from a running instance, or -1 if there is
+ * none listening on path. */
+static int
+takeover(const char *path)
+{
+	struct sockaddr_un un;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	int fd, sfd;
+	char c;
+
+	unaddr(&un, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		err(1, "socket handoff");
+	}
+
+	if (connect(fd, (struct sockaddr *)&un, sizeof(un)) == -1) {
+		if (errno != ENOENT && errno != ECONNREFUSED) {
+			err(1, "connect handoff");
+		}
+
+		(void)close(fd);
+		errno = 0;
+		return -1;
+	}
+
+	(void)memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	if (recvmsg(fd, &msg, 0) <= 0) {
+		err(1, "recvmsg handoff");
+	}
+
+	if ((cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+		|| cmsg->cmsg_level != SOL_SOCKET
+		|| cmsg->cmsg_type != SCM_RIGHTS) {
+		errx(1, "handoff sent no descriptor");
+	}
+
+	(void)memcpy(&sfd, CMSG_DATA(cmsg), sizeof(sfd));
+
+	if (close(fd) == -1) {
+		warn("close handoff");
+	}
+
+	return sfd;
+}
+
+static int
+ctlsocket(const char *path)
+{
+	struct sockaddr_un un;
+	int fd;
+
+	unaddr(&un, path);
+
+	if (unlink(path) == -1 && errno != ENOENT) {
+		err(1, "unlink %s", path);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		err(1, "socket ctl");
+	}
+
+	if (bind(fd, (struct sockaddr *)&un, sizeof(un)) == -1) {
+		err(1, "bind %s", path);
+	}
+
+	if (listen(fd, 1) == -1) {
+		err(1, "listen ctl");
+	}
+
+	return fd;
+}
+
+/* Pass sfd to the successor and exit; queued connections stay queued. */
+static void
+handoff(int cfd, int sfd)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	int fd;
+	char c;
+
+	if ((fd = accept(cfd, NULL, NULL)) == -1) {
+		warn("accept handoff");
+		return;
+	}
+
+	(void)memset(&msg, 0, sizeof(msg));
+	(void)memset(&cbuf, 0, sizeof(cbuf));
+	c = 0;
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	(void)memcpy(CMSG_DATA(cmsg), &sfd, sizeof(sfd));
+
+	if (sendmsg(fd, &msg, 0) == -1) {
+		warn("sendmsg handoff");
+		(void)close(fd);
+		return;
+	}
+
+	exit(0);
+}
@@ -1,7 +1,153 @@
 #ifndef FILESRV_H
 #define FILESRV_H
 
-void	respond(int, char *, size_t);
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LIMIT_MAX	16
+#define TAR_BLOCK	512
+#define SHA256_LEN	32
+#define MIME_LEN	64
+
+struct limit {
+	char	*prefix;	/* request path prefix */
+	size_t	 len;
+	size_t	 rate;		/* bytes/s */
+};
+
+struct srv {
+	char	*dir;
+	size_t	 dirlen;
+	time_t	 timeout;	/* request header deadline, seconds */
+	size_t	 minrate;	/* minimum body transfer rate, bytes/s */
+	struct limit limits[LIMIT_MAX];
+	size_t	 nlimits;
+	off_t	 bulksize;	/* files at least this large go to children */
+	int	 maxbulk;	/* 0 disables bulk children */
+	int	 nbulk;
+	int	 maxfollow;	/* 0 disables following files */
+	int	 nfollow;
+	pid_t	*fpid;		/* followers, 0 for free slots */
+	int	 lfd[2];	/* listening sockets, closed in children */
+	off_t	 evictsize;	/* uncache files this large as they are sent */
+	int	 nhash;		/* digest threads, 0 to disable digests */
+	int	 xattr;		/* store digests in extended attributes */
+	uint64_t slow;		/* slow request log threshold, ms, or 0 */
+	int	 vhost;		/* serve the subdirectory named by Host */
+	int	 trace;		/* record requests */
+};
+
+/* Pack file, as written by mkpack: the header, the entries sorted by name,
+ * the NUL-terminated names, then the bodies. Offsets are from the start of
+ * the file, in host byte order. */
+#define PACK_MAGIC	"FSRVPAK1"
+
+struct packhdr {
+	char	 magic[8];
+	uint64_t n;
+};
+
+struct packent {
+	uint64_t name;		/* relative to the mount point */
+	uint64_t off;
+	uint64_t size;
+	int64_t	 sec;		/* modification time */
+	int64_t	 nsec;
+	uint8_t	 md[SHA256_LEN];
+	char	 mime[MIME_LEN];
+};
+
+/* A pack entry found for a request. */
+struct packfile {
+	const char *body;
+	const struct packent *ent;
+};
+
+/* Request trace, as written by -R: the magic, then a record per request
+ * followed by its target and Host header value, in host byte order. */
+#define TRACE_MAGIC	"FSRVTRC1"
+
+struct tracerec {
+	uint64_t usec;		/* arrival, since the epoch */
+	uint16_t pathlen;	/* request target, query included */
+	uint16_t hostlen;	/* 0 without a Host header */
+	uint8_t	 head;		/* HEAD rather than GET */
+	uint8_t	 pad[3];
+};
+
+/* Steps of offload(). */
+#define FS_DONE		0
+#define FS_RESOLVE	1
+#define FS_STAT		2
+
+struct fsop {
+	struct stat st;
+	int	 fd;		/* open regular file, or -1 */
+	char	*mime;		/* sniffed from fd, or NULL */
+	int	 step;		/* FS_DONE, or the step that failed */
+	int	 err;		/* errno of the failed step */
+};
+
+/* A block manifest from the digest threads, freed with its last reference. */
+struct manifest {
+	int	 refs;
+	size_t	 len;
+	char	 text[];
+};
+
+struct sha256 {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t	 buf[64];
+};
+
+pid_t	bulk(struct srv *);
+int	digestblocks(const struct stat *, const char *, struct manifest **);
+size_t	digesthdr(const struct stat *, const char *, char *, size_t);
+size_t	digestfmt(const uint8_t *, char *, size_t);
+void	digestinit(int, int);
+void	digestrelease(struct manifest *);
+int	flightjoin(int, off_t, off_t);
+void	flightinit(void);
+void	flightleave(int);
+int	flightstep(int, int, off_t);
+pid_t	follower(struct srv *);
+void	indexdel(const char *);
+int	indexget(const char *, struct stat *, char *, size_t);
+void	indexinit(const char *, int, size_t);
+int	indexneg(const char *, uint64_t *);
+void	indexnoent(const char *, uint64_t);
+int	indexopen(const char *);
+void	indexput(const char *, const struct stat *, const char *);
+void	indexwatch(void);
+int	offload(const char *, char *, struct fsop *);
+void	offloadinit(int, int, int);
+void	offloadlog(void);
+int	packget(const char *, struct packfile *);
+void	packmount(char *);
+int	profinit(char *);
+void	profstart(void);
+int	respond(int, struct srv *);
+void	sha256_final(struct sha256 *, uint8_t *);
+void	sha256_init(struct sha256 *);
+void	sha256_update(struct sha256 *, const void *, size_t);
+void	shed(int);
 char *	sniff(int, char *);
+int	tarhdr(char *, const char *, const struct stat *);
+void	tarlong(char *, size_t);
+off_t	tarsize(const char *, const struct stat *);
+void	trace(int, const char *, const char *);
+int	traceopen(const char *);
+const char *	vhost(const char *, size_t *);
+void	vhostinit(const char *, const char *);
+void	warminit(char *, size_t);
+void	warmstart(const char *, int);
+void	workerconn(int);
+void	workerinit(void);
+int	workers(const int *, int);
 
 #endif
@@ -0,0 +1,330 @@
+/* Concurrent transfers of the same file share one read stream. The page
+ * cache already keeps a single copy of the file for all of them; what they
+ * must not do is each read ahead at its own offset, which turns one
+ * sequential read into seeks between every reader, or each drop the pages
+ * behind it that a slower reader still needs. Readers of the same version
+ * of a file join a stream in a table shared by all processes. Only the
+ * reader in front reads ahead, and pages are only dropped once the last
+ * reader is past them, so the span between the two is a ring the others
+ * catch up through. New readers join until the front is RING_LEN into the
+ * file, and a reader that falls more than RING_LEN behind the front leaves
+ * and carries on alone. */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define FLIGHTS		64
+#define READERS		32
+#define RING_LEN	((off_t)64 << 20)
+
+struct flight {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t	 size;
+	int64_t	 sec;
+	long	 nsec;
+	off_t	 ralen;		/* readahead ahead of the front */
+	off_t	 lag;		/* kept cached behind the back, 0 to keep all */
+	off_t	 ra;		/* end of the readahead issued */
+	off_t	 dropped;	/* pages below were dropped */
+	int	 nreaders;
+	pid_t	 pid[READERS];	/* 0 if the slot is free */
+	off_t	 pos[READERS];
+};
+
+struct table {
+	pthread_mutex_t lock;	/* process-shared, robust */
+	struct flight f[FLIGHTS];
+};
+
+static struct table *	tab;
+
+static int	tlock(int);
+static int	same(const struct flight *, const struct stat *, off_t, off_t);
+static int	slot(struct flight *);
+static void	reap(struct flight *);
+static void	advise(int, off_t, off_t, int);
+
+/* Set up the table, before any process that serves files is forked. */
+void
+flightinit(void)
+{
+	pthread_mutexattr_t attr;
+	void *p;
+
+	if ((p = mmap(NULL, sizeof(*tab), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		err(1, "flight: mmap");
+	}
+
+	tab = p;
+
+	if ((errno = pthread_mutexattr_init(&attr)) != 0
+		|| (errno = pthread_mutexattr_setpshared(&attr,
+		PTHREAD_PROCESS_SHARED)) != 0
+		|| (errno = pthread_mutexattr_setrobust(&attr,
+		PTHREAD_MUTEX_ROBUST)) != 0
+		|| (errno = pthread_mutex_init(&tab->lock, &attr)) != 0) {
+		err(1, "flight: mutex");
+	}
+
+	(void)pthread_mutexattr_destroy(&attr);
+}
+
+/* Join the stream reading fd from the start, reading ralen ahead and
+ * keeping lag behind, or start one. Returns the reader's id, or -1 to read
+ * alone. */
+int
+flightjoin(int fd, off_t ralen, off_t lag)
+{
+	struct flight *f, *empty;
+	struct stat st;
+	int i, j;
+
+	if (tab == NULL || fstat(fd, &st) == -1 || tlock(1) == -1) {
+		return -1;
+	}
+
+	empty = NULL;
+
+	for (i = 0; i < FLIGHTS; i++) {
+		f = &tab->f[i];
+
+		if (f->nreaders != 0 && same(f, &st, ralen, lag)) {
+			reap(f);
+
+			/* Late joiners catch up while the ring still holds the
+			 * start of the file. */
+			if (f->nreaders != 0 && f->ra <= RING_LEN
+				&& (j = slot(f)) != -1) {
+				break;
+			}
+		}
+
+		if (f->nreaders == 0 && empty == NULL) {
+			empty = f;
+		}
+	}
+
+	if (i == FLIGHTS) {
+		/* Readers that died without leaving hold on to their
+		 * streams. */
+		for (i = 0; empty == NULL && i < FLIGHTS; i++) {
+			reap(&tab->f[i]);
+
+			if (tab->f[i].nreaders == 0) {
+				empty = &tab->f[i];
+			}
+		}
+
+		if (empty == NULL) {
+			(void)pthread_mutex_unlock(&tab->lock);
+			return -1;
+		}
+
+		f = empty;
+		i = (int)(f - tab->f);
+
+		(void)memset(f, 0, sizeof(*f));
+		f->dev = (uint64_t)st.st_dev;
+		f->ino = (uint64_t)st.st_ino;
+		f->size = (int64_t)st.st_size;
+		f->sec = (int64_t)st.st_mtim.tv_sec;
+		f->nsec = st.st_mtim.tv_nsec;
+		f->ralen = ralen;
+		f->lag = lag;
+		j = 0;
+	}
+
+	f->pid[j] = getpid();
+	f->pos[j] = 0;
+	f->nreaders++;
+
+	(void)pthread_mutex_unlock(&tab->lock);
+	return i * READERS + j;
+}
+
+/* Record that reader id has sent up to pos of fd, reading ahead if it is in
+ * front and dropping what every reader is done with. Returns -1 if the
+ * reader is no longer in the stream and must look after itself. */
+int
+flightstep(int id, int fd, off_t pos)
+{
+	struct flight *f;
+	off_t raoff, ralen, dropoff, droplen, lead, back;
+	int i, j;
+
+	f = &tab->f[id / READERS];
+	j = id % READERS;
+
+	/* Skipping a step only delays the hints. */
+	if (tlock(0) == -1) {
+		return 0;
+	}
+
+	if (f->pid[j] != getpid()) {
+		(void)pthread_mutex_unlock(&tab->lock);
+		return -1;
+	}
+
+	f->pos[j] = pos;
+	lead = back = pos;
+
+	for (i = 0; i < READERS; i++) {
+		if (f->pid[i] == 0) {
+			continue;
+		}
+
+		if (f->pos[i] > lead) {
+			lead = f->pos[i];
+		}
+
+		if (f->pos[i] < back) {
+			back = f->pos[i];
+		}
+	}
+
+	if (lead - pos > RING_LEN) {
+		f->pid[j] = 0;
+		f->nreaders--;
+		(void)pthread_mutex_unlock(&tab->lock);
+		return -1;
+	}
+
+	raoff = ralen = 0;
+
+	if (pos + f->ralen > f->ra) {
+		raoff = pos > f->ra ? pos : f->ra;
+		ralen = pos + f->ralen - raoff;
+		f->ra = pos + f->ralen;
+	}
+
+	dropoff = droplen = 0;
+
+	/* Nothing is dropped while the stream takes new readers. */
+	if (f->lag != 0 && f->ra > RING_LEN
+		&& back - f->dropped >= 2 * f->lag) {
+		dropoff = f->dropped;
+		droplen = back - f->lag - dropoff;
+		f->dropped = back - f->lag;
+	}
+
+	(void)pthread_mutex_unlock(&tab->lock);
+
+	if (ralen != 0) {
+		advise(fd, raoff, ralen, 1);
+	}
+
+	if (droplen != 0) {
+		advise(fd, dropoff, droplen, 0);
+	}
+
+	return 0;
+}
+
+void
+flightleave(int id)
+{
+	struct flight *f;
+	int j;
+
+	f = &tab->f[id / READERS];
+	j = id % READERS;
+
+	if (tlock(1) == -1) {
+		return;
+	}
+
+	if (f->pid[j] == getpid()) {
+		f->pid[j] = 0;
+		f->nreaders--;
+	}
+
+	(void)pthread_mutex_unlock(&tab->lock);
+}
+
+/* Lock the table, waiting only if block is set. */
+static int
+tlock(int block)
+{
+	int rv;
+
+	rv = block ? pthread_mutex_lock(&tab->lock)
+		: pthread_mutex_trylock(&tab->lock);
+
+	if (rv == EOWNERDEAD) {
+		/* A reader died holding it, maybe halfway through a change.
+		 * Everyone else finds out they were dropped on their next
+		 * step. */
+		(void)memset(tab->f, 0, sizeof(tab->f));
+		(void)pthread_mutex_consistent(&tab->lock);
+		rv = 0;
+	}
+
+	return rv == 0 ? 0 : -1;
+}
+
+static int
+same(const struct flight *f, const struct stat *st, off_t ralen, off_t lag)
+{
+	return f->dev == (uint64_t)st->st_dev && f->ino == (uint64_t)st->st_ino
+		&& f->size == (int64_t)st->st_size
+		&& f->sec == (int64_t)st->st_mtim.tv_sec
+		&& f->nsec == st->st_mtim.tv_nsec
+		&& f->ralen == ralen && f->lag == lag;
+}
+
+static int
+slot(struct flight *f)
+{
+	int j;
+
+	for (j = 0; j < READERS; j++) {
+		if (f->pid[j] == 0) {
+			return j;
+		}
+	}
+
+	return -1;
+}
+
+/* Free the slots of readers that died, say of a killed bulk child. */
+static void
+reap(struct flight *f)
+{
+	int j;
+
+	for (j = 0; j < READERS; j++) {
+		if (f->pid[j] != 0 && kill(f->pid[j], 0) == -1
+			&& errno == ESRCH) {
+			f->pid[j] = 0;
+			f->nreaders--;
+		}
+	}
+}
+
+/* posix_fadvise(2) where available; the advice is only ever a hint. */
+static void
+advise(int fd, off_t off, off_t len, int willneed)
+{
+#ifdef POSIX_FADV_WILLNEED
+	(void)posix_fadvise(fd, off, len, willneed ? POSIX_FADV_WILLNEED
+		: POSIX_FADV_DONTNEED);
+#else
+	(void)fd;
+	(void)off;
+	(void)len;
+	(void)willneed;
+#endif
+}
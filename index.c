@@ -0,0 +1,1275 @@
+/* Metadata index of the served tree: a hash table of request paths kept in a
+ * mapped file, so it survives restarts. A path found here skips realpath()
+ * and stat(). The file is still opened without following links and checked
+ * against the entry, so a stale entry only costs a fallback to the slow path.
+ * The table is kept current by crawling the tree at startup and, on Linux,
+ * by inotify. Only the process that called indexwatch() writes it; workers
+ * forked before that only read it.
+ *
+ * On Linux, paths that failed to resolve are also remembered, in an LRU
+ * table shared with the workers, and answered with a 404 without touching
+ * the filesystem. An entry is only made when the directory the path stops
+ * existing in is watched, and any creation or rename into place drops the
+ * entries at and below the new name. */
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define MAGIC		"filesrv\1"
+#define HDR_LEN		8192
+#define MIME_MAX	64
+#define SLOTS_MIN	4096
+
+#define EV_LEN		(64 << 10)
+
+#define NEG_MIN		64
+#define NEG_KEY		104	/* longer paths aren't remembered */
+#define NIL		UINT32_MAX
+
+#ifdef __linux__
+#define EV_MASK		(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+			| IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW \
+			| IN_EXCL_UNLINK)
+#endif
+
+struct ihdr {
+	char	 magic[8];
+	uint64_t dev;		/* of the served directory */
+	uint64_t ino;
+	uint64_t nslots;	/* power of two */
+	uint64_t nused;
+	uint32_t nmime;
+	uint32_t pad;
+	char	 mime[MIME_MAX][MIME_LEN];
+};
+
+/* One cache line per entry. */
+struct ient {
+	uint64_t hash;		/* of the path, 0 if the slot is empty */
+	uint64_t dev;
+	uint64_t ino;
+	int64_t	 size;
+	int64_t	 sec;
+	uint32_t nsec;
+	uint32_t mode;
+	uint32_t mime;		/* 1-based index into ihdr.mime, or 0 */
+	uint32_t pad[3];
+};
+
+/* A path known not to exist. */
+struct nent {
+	uint64_t hash;		/* of the path, 0 if the entry is unused */
+	uint32_t next;		/* in the hash chain */
+	uint32_t newer;		/* in the LRU list */
+	uint32_t older;
+	uint32_t pad;
+	char	 key[NEG_KEY];
+};
+
+/* Followed in the same mapping by n chain heads and n entries. */
+struct neg {
+	pthread_mutex_t lock;	/* process-shared, robust */
+	uint64_t epoch;		/* bumped by every creation and flush */
+	uint32_t n;		/* power of two */
+	uint32_t head;		/* most recently used */
+	uint32_t tail;		/* least recently used or unused */
+	uint32_t off;		/* creations might go unseen */
+};
+
+enum {
+	KEEP = -1
+};
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	more = PTHREAD_COND_INITIALIZER;
+static const char *	root;	/* the served directory */
+static int		ifd = -1;
+static struct ihdr *	hdr;
+static struct ient *	tab;
+static size_t		nslots;	/* own copy, hdr may be rewritten */
+static int		stale;	/* reused from a previous run */
+static int		owner;	/* this process writes the index */
+static int		ncrawl;
+
+/* Directories left to crawl. */
+static char **		dirs;
+static size_t		ndirs, capdirs;
+static int		busy;
+
+#ifdef __linux__
+static int		nfd = -1;
+static char **		watch;	/* directory of each watch descriptor */
+static size_t		nwatch;
+static int		wfull;	/* some directory couldn't be watched */
+#endif
+
+/* Negative entries, shared with the workers. */
+static struct neg *	neg;
+static uint32_t *	nchain;
+static struct nent *	nent;
+
+static int	map(size_t);
+static int	remap(void);
+static void	neginit(size_t);
+static int	nlock(int);
+static void	negflush(void);
+static void	negon(int);
+static void	negcreate(const char *);
+static int	missing(const char *, char *);
+static void	unchain(uint32_t);
+static void	lrudel(uint32_t);
+static void	lruhead(uint32_t);
+static void	lrutail(uint32_t);
+static int	grow(void);
+static size_t	find(uint64_t);
+static void	insert(uint64_t, const struct stat *, int, int);
+static void	delete(size_t);
+static int	mimeid(const char *);
+static uint64_t	hash(const char *);
+static void	crawl(void);
+static void *	crawler(void *);
+static void	scan(const char *);
+static int	push(const char *, const char *);
+static int	join(char *, const char *, const char *);
+static int	abspath(char *, const char *);
+static void	setlock(void);
+static void	prefork(void);
+static void	postfork(void);
+static void *	watcher(void *);
+#ifdef __linux__
+static void	addwatch(const char *);
+static void	unwatch(const char *);
+static void	event(struct inotify_event *);
+#endif
+
+/* Open and lock the index file. Waits for a previous filesrv using it to
+ * exit, so only one process ever writes it. Returns the descriptor, which
+ * must stay open. */
+int
+indexopen(const char *file)
+{
+	if ((ifd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		err(1, "open %s", file);
+	}
+
+	setlock();
+
+	return ifd;
+}
+
+/* Map the index for the served directory dir, or start a new one if the
+ * file doesn't hold one for it, and set up nneg negative entries. indexwatch()
+ * fills them in. */
+void
+indexinit(const char *dir, int n, size_t nneg)
+{
+	struct stat st, rst;
+	size_t slots;
+
+	if (ifd == -1) {
+		return;
+	}
+
+	root = dir;
+	ncrawl = n > 0 ? n : 1;
+
+#ifdef __linux__
+	/* Before any workers are forked, so they share it. */
+	if (nneg > 0) {
+		neginit(nneg);
+	}
+#else
+	(void)nneg;
+#endif
+
+	if (fstat(ifd, &st) == -1 || stat(root, &rst) == -1) {
+		err(1, "index: stat");
+	}
+
+	if (st.st_size > HDR_LEN && (size_t)st.st_size <= SIZE_MAX
+		&& (slots = ((size_t)st.st_size - HDR_LEN)
+		/ sizeof(struct ient)) != 0 && (slots & (slots - 1)) == 0
+		&& (size_t)st.st_size == HDR_LEN + slots * sizeof(struct ient)
+		&& map(slots) == 0) {
+		if (memcmp(hdr->magic, MAGIC, sizeof(hdr->magic)) == 0
+			&& hdr->nslots == slots
+			&& hdr->dev == (uint64_t)rst.st_dev
+			&& hdr->ino == (uint64_t)rst.st_ino) {
+			stale = 1;
+			return;
+		}
+
+		(void)munmap(hdr, HDR_LEN + nslots * sizeof(struct ient));
+	}
+
+	if (ftruncate(ifd, 0) == -1 || ftruncate(ifd, (off_t)(HDR_LEN
+		+ SLOTS_MIN * sizeof(struct ient))) == -1) {
+		err(1, "index: ftruncate");
+	}
+
+	if (map(SLOTS_MIN) == -1) {
+		err(1, "index: mmap");
+	}
+
+	hdr->dev = (uint64_t)rst.st_dev;
+	hdr->ino = (uint64_t)rst.st_ino;
+	hdr->nslots = SLOTS_MIN;
+}
+
+/* Fill in and start keeping the index current, once the process is done
+ * forking. A new index is crawled with ncrawl threads before returning. One
+ * reused from a previous run is crawled again in the background instead,
+ * since the tree may have changed while nobody was watching. */
+void
+indexwatch(void)
+{
+	pthread_t t;
+
+	if (ifd == -1) {
+		return;
+	}
+
+	/* Record locks don't survive fork(). */
+	setlock();
+	owner = 1;
+
+	/* A process forked while a thread holds the lock would never get
+	 * it. */
+	if ((errno = pthread_atfork(prefork, postfork, postfork)) != 0) {
+		err(1, "pthread_atfork");
+	}
+
+#ifdef __linux__
+	if ((nfd = inotify_init1(IN_CLOEXEC)) == -1) {
+		warn("inotify_init1");
+	}
+#endif
+
+	if (!stale) {
+		crawl();
+
+		/* Written last, so an interrupted build isn't reused. */
+		(void)memcpy(hdr->magic, MAGIC, sizeof(hdr->magic));
+	}
+
+	if ((errno = pthread_create(&t, NULL, watcher, NULL)) != 0) {
+		err(1, "pthread_create");
+	}
+
+	(void)pthread_detach(t);
+}
+
+/* Look up a canonical path relative to the served directory. On a hit, fill
+ * in st and copy the MIME type, if known, into mime. Never blocks. */
+int
+indexget(const char *key, struct stat *st, char *mime, size_t len)
+{
+	struct ient *e;
+	size_t i;
+
+	if (tab == NULL || pthread_mutex_trylock(&lock) != 0) {
+		return -1;
+	}
+
+	/* The owner grew the table since this process mapped it. */
+	if (hdr->nslots != nslots && remap() == -1) {
+		(void)pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	i = find(hash(key));
+	e = &tab[i];
+
+	if (e->hash == 0) {
+		(void)pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	(void)memset(st, 0, sizeof(*st));
+	st->st_dev = (dev_t)e->dev;
+	st->st_ino = (ino_t)e->ino;
+	st->st_size = (off_t)e->size;
+	st->st_mode = (mode_t)e->mode;
+	st->st_mtim.tv_sec = (time_t)e->sec;
+	st->st_mtim.tv_nsec = (long)e->nsec;
+
+	mime[0] = '\0';
+	if (e->mime != 0 && e->mime <= hdr->nmime
+		&& strlen(hdr->mime[e->mime - 1]) < len) {
+		(void)memcpy(mime, hdr->mime[e->mime - 1],
+			strlen(hdr->mime[e->mime - 1]) + 1);
+	}
+
+	(void)pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/* Record a canonical path found by a request. mime may be NULL if unknown.
+ * Never blocks, and leaves growing the table to the watcher. */
+void
+indexput(const char *key, const struct stat *st, const char *mime)
+{
+	if (!owner || tab == NULL || pthread_mutex_trylock(&lock) != 0) {
+		return;
+	}
+
+#ifdef __linux__
+	if (S_ISDIR(st->st_mode)) {
+		addwatch(key);
+	}
+#endif
+
+	insert(hash(key), st, mime != NULL ? mimeid(mime) : 0, 0);
+
+	(void)pthread_mutex_unlock(&lock);
+}
+
+/* Forget a path that no longer exists. */
+void
+indexdel(const char *key)
+{
+	size_t i;
+
+	if (!owner || tab == NULL || pthread_mutex_trylock(&lock) != 0) {
+		return;
+	}
+
+	if (tab[i = find(hash(key))].hash != 0) {
+		delete(i);
+	}
+
+	(void)pthread_mutex_unlock(&lock);
+}
+
+/* Whether a canonical path is known not to exist. Also sets epoch for a
+ * later indexnoent(), to be called before resolving the path. Never
+ * blocks. */
+int
+indexneg(const char *key, uint64_t *epoch)
+{
+	uint64_t h;
+	uint32_t i;
+	int rv;
+
+	*epoch = 0;
+
+	if (neg == NULL || nlock(0) == -1) {
+		return 0;
+	}
+
+	rv = 0;
+
+	if (!neg->off) {
+		*epoch = neg->epoch;
+		h = hash(key);
+
+		for (i = nchain[h & (neg->n - 1)]; i != NIL; i = nent[i].next) {
+			if (nent[i].hash == h && strcmp(nent[i].key, key) == 0) {
+				lruhead(i);
+				rv = 1;
+				break;
+			}
+		}
+	}
+
+	(void)pthread_mutex_unlock(&neg->lock);
+	return rv;
+}
+
+/* Remember a canonical path that failed to resolve with ENOENT, unless
+ * anything was created since indexneg() gave out epoch. */
+void
+indexnoent(const char *key, uint64_t epoch)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint64_t h;
+	uint32_t i, *head;
+	size_t len;
+
+	if (neg == NULL || epoch == 0 || (len = strlen(key)) >= NEG_KEY
+		|| missing(key, path) == -1) {
+		return;
+	}
+
+	/* The index may lag behind, and leaves out links. */
+	if (lstat(path, &st) == 0 || errno != ENOENT) {
+		return;
+	}
+
+	if (nlock(0) == -1) {
+		return;
+	}
+
+	if (neg->off || neg->epoch != epoch) {
+		(void)pthread_mutex_unlock(&neg->lock);
+		return;
+	}
+
+	h = hash(key);
+	head = &nchain[h & (neg->n - 1)];
+
+	for (i = *head; i != NIL; i = nent[i].next) {
+		if (nent[i].hash == h && strcmp(nent[i].key, key) == 0) {
+			break;
+		}
+	}
+
+	if (i == NIL) {
+		i = neg->tail;
+
+		if (nent[i].hash != 0) {
+			unchain(i);
+		}
+
+		nent[i].hash = h;
+		(void)memcpy(nent[i].key, key, len + 1);
+		nent[i].next = *head;
+		*head = i;
+	}
+
+	lruhead(i);
+
+	(void)pthread_mutex_unlock(&neg->lock);
+}
+
+static int
+map(size_t slots)
+{
+	void *p;
+
+	if ((p = mmap(NULL, HDR_LEN + slots * sizeof(struct ient),
+		PROT_READ | PROT_WRITE, MAP_SHARED, ifd, 0)) == MAP_FAILED) {
+		return -1;
+	}
+
+	hdr = p;
+	tab = (struct ient *)((char *)p + HDR_LEN);
+	nslots = slots;
+
+	return 0;
+}
+
+/* Map the table at the size the owner last grew it to. The file grows
+ * before the header says so, so the new size is always backed. */
+static int
+remap(void)
+{
+	size_t n;
+
+	n = (size_t)hdr->nslots;
+
+	if (n == 0 || (n & (n - 1)) != 0) {
+		return -1;
+	}
+
+	(void)munmap(hdr, HDR_LEN + nslots * sizeof(struct ient));
+
+	if (map(n) == -1) {
+		hdr = NULL;
+		tab = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Double the table. Called with the lock held. */
+static int
+grow(void)
+{
+	struct ient *old;
+	size_t i, n;
+
+	n = nslots;
+
+	if ((old = malloc(n * sizeof(struct ient))) == NULL) {
+		warn("index: malloc");
+		return -1;
+	}
+
+	(void)memcpy(old, tab, n * sizeof(struct ient));
+	(void)munmap(hdr, HDR_LEN + n * sizeof(struct ient));
+
+	if (ftruncate(ifd, (off_t)(HDR_LEN + 2 * n * sizeof(struct ient)))
+		== -1 || map(2 * n) == -1) {
+		err(1, "index: grow");
+	}
+
+	(void)memset(tab, 0, nslots * sizeof(struct ient));
+	hdr->nslots = nslots;
+	hdr->nused = 0;
+
+	for (i = 0; i < n; i++) {
+		if (old[i].hash != 0) {
+			tab[find(old[i].hash)] = old[i];
+			hdr->nused++;
+		}
+	}
+
+	free(old);
+	return 0;
+}
+
+/* Slot holding hash, or the empty slot where it would go. */
+static size_t
+find(uint64_t h)
+{
+	size_t i;
+
+	for (i = (size_t)h & (nslots - 1); tab[i].hash != 0
+		&& tab[i].hash != h; i = (i + 1) & (nslots - 1)) {
+	}
+
+	return i;
+}
+
+/* Called with the lock held. mime is KEEP to leave a known type alone. */
+static void
+insert(uint64_t h, const struct stat *st, int mime, int cangrow)
+{
+	struct ient *e;
+
+	if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)) {
+		return;
+	}
+
+	e = &tab[find(h)];
+
+	if (e->hash == 0) {
+		/* Kept at most half full so probes stay short. */
+		if (2 * (hdr->nused + 1) > nslots) {
+			if (!cangrow || grow() == -1) {
+				return;
+			}
+
+			e = &tab[find(h)];
+		}
+
+		hdr->nused++;
+		e->mime = 0;
+	} else if (e->size != (int64_t)st->st_size
+		|| e->sec != (int64_t)st->st_mtim.tv_sec
+		|| e->nsec != (uint32_t)st->st_mtim.tv_nsec) {
+		/* New contents may sniff differently. */
+		e->mime = 0;
+	}
+
+	e->hash = h;
+	e->dev = (uint64_t)st->st_dev;
+	e->ino = (uint64_t)st->st_ino;
+	e->size = (int64_t)st->st_size;
+	e->sec = (int64_t)st->st_mtim.tv_sec;
+	e->nsec = (uint32_t)st->st_mtim.tv_nsec;
+	e->mode = (uint32_t)st->st_mode;
+
+	if (mime != KEEP) {
+		e->mime = (uint32_t)mime;
+	}
+}
+
+/* Empty slot i, moving later entries of its probe sequence back so
+ * lookups don't stop short. */
+static void
+delete(size_t i)
+{
+	size_t j, k, mask;
+
+	mask = nslots - 1;
+	hdr->nused--;
+
+	for (j = i;;) {
+		tab[i].hash = 0;
+
+		do {
+			j = (j + 1) & mask;
+
+			if (tab[j].hash == 0) {
+				return;
+			}
+
+			k = (size_t)tab[j].hash & mask;
+		} while (i <= j ? i < k && k <= j : i < k || k <= j);
+
+		tab[i] = tab[j];
+		i = j;
+	}
+}
+
+/* MIME types are interned in the header. Returns 0 if the table is full. */
+static int
+mimeid(const char *mime)
+{
+	uint32_t i;
+	size_t len;
+
+	for (i = 0; i < hdr->nmime; i++) {
+		if (strcmp(hdr->mime[i], mime) == 0) {
+			return (int)i + 1;
+		}
+	}
+
+	if (i == MIME_MAX || (len = strlen(mime)) >= MIME_LEN) {
+		return 0;
+	}
+
+	(void)memcpy(hdr->mime[i], mime, len + 1);
+	hdr->nmime++;
+
+	return (int)i + 1;
+}
+
+/* FNV-1a. 0 marks empty slots. */
+static uint64_t
+hash(const char *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *key != '\0'; key++) {
+		h = (h ^ (uint8_t)*key) * 0x100000001b3ULL;
+	}
+
+	return h != 0 ? h : 1;
+}
+
+/* Walk the tree from the current directory with ncrawl threads. */
+static void
+crawl(void)
+{
+	pthread_t *t;
+	struct stat st;
+	int i;
+
+	if (stat(root, &st) == -1) {
+		warn("index: stat");
+		return;
+	}
+
+	(void)pthread_mutex_lock(&lock);
+	insert(hash(""), &st, KEEP, 1);
+	if (push("", "") == -1) {
+		(void)pthread_mutex_unlock(&lock);
+		return;
+	}
+	(void)pthread_mutex_unlock(&lock);
+
+	if ((t = calloc((size_t)ncrawl, sizeof(*t))) == NULL) {
+		err(1, "index: calloc");
+	}
+
+	for (i = 0; i < ncrawl; i++) {
+		if ((errno = pthread_create(&t[i], NULL, crawler, NULL)) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+
+	for (i = 0; i < ncrawl; i++) {
+		(void)pthread_join(t[i], NULL);
+	}
+
+	free(t);
+}
+
+static void *
+crawler(void *arg)
+{
+	char *dir;
+
+	(void)arg;
+
+	(void)pthread_mutex_lock(&lock);
+
+	while (1) {
+		while (ndirs == 0 && busy > 0) {
+			(void)pthread_cond_wait(&more, &lock);
+		}
+
+		if (ndirs == 0) {
+			break;
+		}
+
+		dir = dirs[--ndirs];
+		busy++;
+
+		(void)pthread_mutex_unlock(&lock);
+		scan(dir);
+		free(dir);
+		(void)pthread_mutex_lock(&lock);
+
+		busy--;
+	}
+
+	(void)pthread_cond_broadcast(&more);
+	(void)pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/* Index the entries of one directory and queue its subdirectories. Links
+ * are left out, like the slow path never yields them either. */
+static void
+scan(const char *dir)
+{
+	char key[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	DIR *d;
+
+	if (abspath(key, dir) == -1 || (d = opendir(key)) == NULL) {
+		return;
+	}
+
+#ifdef __linux__
+	(void)pthread_mutex_lock(&lock);
+	addwatch(dir);
+	(void)pthread_mutex_unlock(&lock);
+#endif
+
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0
+			|| strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW)
+			== -1 || join(key, dir, ent->d_name) == -1) {
+			continue;
+		}
+
+		(void)pthread_mutex_lock(&lock);
+		insert(hash(key), &st, KEEP, 1);
+
+		if (S_ISDIR(st.st_mode) && push(dir, ent->d_name) == 0) {
+			(void)pthread_cond_signal(&more);
+		}
+		(void)pthread_mutex_unlock(&lock);
+	}
+
+	(void)closedir(d);
+}
+
+/* Queue dir/name for crawling. Called with the lock held. */
+static int
+push(const char *dir, const char *name)
+{
+	char key[PATH_MAX];
+	char **p;
+	size_t n;
+
+	if (join(key, dir, name) == -1) {
+		return -1;
+	}
+
+	if (ndirs == capdirs) {
+		n = capdirs != 0 ? 2 * capdirs : 64;
+
+		if ((p = reallocarray(dirs, n, sizeof(*dirs))) == NULL) {
+			warn("index: reallocarray");
+			return -1;
+		}
+
+		dirs = p;
+		capdirs = n;
+	}
+
+	if ((dirs[ndirs] = strdup(key)) == NULL) {
+		warn("index: strdup");
+		return -1;
+	}
+
+	ndirs++;
+	return 0;
+}
+
+/* Keys are relative to the served directory, without leading or trailing
+ * slashes; the directory itself is the empty string. */
+static int
+join(char *key, const char *dir, const char *name)
+{
+	int n;
+
+	n = snprintf(key, PATH_MAX, "%s%s%s", dir, dir[0] == '\0' || name[0]
+		== '\0' ? "" : "/", name);
+
+	return n < 0 || n >= PATH_MAX ? -1 : 0;
+}
+
+/* The served directory may not be the working directory once daemonized. */
+static int
+abspath(char *path, const char *key)
+{
+	int n;
+
+	n = snprintf(path, PATH_MAX, "%s%s%s", root, root[strlen(root) - 1]
+		== '/' || key[0] == '\0' ? "" : "/", key);
+
+	return n < 0 || n >= PATH_MAX ? -1 : 0;
+}
+
+static void
+setlock(void)
+{
+	struct flock fl;
+
+	(void)memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	while (fcntl(ifd, F_SETLKW, &fl) == -1) {
+		if (errno != EINTR) {
+			err(1, "index: lock");
+		}
+	}
+}
+
+static void
+neginit(size_t n)
+{
+	pthread_mutexattr_t attr;
+	size_t len, m;
+	void *p;
+
+	for (m = NEG_MIN; m < n; m *= 2) {
+	}
+
+	len = sizeof(*neg) + m * (sizeof(*nchain) + sizeof(*nent));
+
+	if ((p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		err(1, "index: mmap");
+	}
+
+	neg = p;
+	nchain = (uint32_t *)(neg + 1);
+	nent = (struct nent *)(nchain + m);
+
+	if ((errno = pthread_mutexattr_init(&attr)) != 0
+		|| (errno = pthread_mutexattr_setpshared(&attr,
+		PTHREAD_PROCESS_SHARED)) != 0
+		|| (errno = pthread_mutexattr_setrobust(&attr,
+		PTHREAD_MUTEX_ROBUST)) != 0
+		|| (errno = pthread_mutex_init(&neg->lock, &attr)) != 0) {
+		err(1, "index: mutex");
+	}
+
+	(void)pthread_mutexattr_destroy(&attr);
+
+	neg->n = (uint32_t)m;
+	neg->off = 1;
+	negflush();
+}
+
+/* Lock the negative entries, waiting only if block is set. */
+static int
+nlock(int block)
+{
+	int rv;
+
+	rv = block ? pthread_mutex_lock(&neg->lock)
+		: pthread_mutex_trylock(&neg->lock);
+
+	if (rv == EOWNERDEAD) {
+		/* A worker died holding it, maybe halfway through a change. */
+		negflush();
+		(void)pthread_mutex_consistent(&neg->lock);
+		rv = 0;
+	}
+
+	return rv == 0 ? 0 : -1;
+}
+
+/* Forget all entries. Called with the negative lock held. */
+static void
+negflush(void)
+{
+	uint32_t i, n;
+
+	n = neg->n;
+
+	for (i = 0; i < n; i++) {
+		nchain[i] = NIL;
+		nent[i].hash = 0;
+		nent[i].next = NIL;
+		nent[i].newer = i > 0 ? i - 1 : NIL;
+		nent[i].older = i + 1 < n ? i + 1 : NIL;
+	}
+
+	neg->head = 0;
+	neg->tail = n - 1;
+	neg->epoch++;
+}
+
+/* Start remembering paths once every indexed directory is watched, or stop
+ * for good when one can't be. */
+static void
+negon(int on)
+{
+	if (neg == NULL || nlock(1) == -1) {
+		return;
+	}
+
+	if (!on) {
+		negflush();
+	}
+
+	neg->off = !on;
+	(void)pthread_mutex_unlock(&neg->lock);
+}
+
+/* key came into existence: drop it and everything below it. */
+static void
+negcreate(const char *key)
+{
+	uint32_t i;
+	size_t len;
+
+	if (neg == NULL || nlock(1) == -1) {
+		return;
+	}
+
+	neg->epoch++;
+	len = strlen(key);
+
+	for (i = 0; i < neg->n; i++) {
+		if (nent[i].hash != 0 && strncmp(nent[i].key, key, len) == 0
+			&& (nent[i].key[len] == '\0' || nent[i].key[len] == '/')) {
+			unchain(i);
+			nent[i].hash = 0;
+			lrutail(i);
+		}
+	}
+
+	(void)pthread_mutex_unlock(&neg->lock);
+}
+
+/* Put the absolute path of the first component of key missing from the index
+ * into path. Indexed directories are watched, so its creation will be seen.
+ * Returns -1 if the index has all of key, or a file where a directory should
+ * be. */
+static int
+missing(const char *key, char *path)
+{
+	char pre[NEG_KEY];
+	char mime[MIME_LEN];
+	struct stat st;
+	char *p;
+	char ch;
+
+	(void)memcpy(pre, key, strlen(key) + 1);
+
+	for (p = pre;; p++) {
+		if (*p != '/' && *p != '\0') {
+			continue;
+		}
+
+		ch = *p;
+		*p = '\0';
+
+		if (indexget(pre, &st, mime, sizeof(mime)) == -1) {
+			break;
+		}
+
+		if (ch == '\0' || !S_ISDIR(st.st_mode)) {
+			return -1;
+		}
+
+		*p = ch;
+	}
+
+	return abspath(path, pre);
+}
+
+/* Remove entry i from its hash chain. */
+static void
+unchain(uint32_t i)
+{
+	uint32_t *p;
+
+	for (p = &nchain[nent[i].hash & (neg->n - 1)]; *p != NIL;
+		p = &nent[*p].next) {
+		if (*p == i) {
+			*p = nent[i].next;
+			break;
+		}
+	}
+
+	nent[i].next = NIL;
+}
+
+static void
+lrudel(uint32_t i)
+{
+	if (nent[i].newer != NIL) {
+		nent[nent[i].newer].older = nent[i].older;
+	} else {
+		neg->head = nent[i].older;
+	}
+
+	if (nent[i].older != NIL) {
+		nent[nent[i].older].newer = nent[i].newer;
+	} else {
+		neg->tail = nent[i].newer;
+	}
+}
+
+static void
+lruhead(uint32_t i)
+{
+	lrudel(i);
+	nent[i].newer = NIL;
+	nent[i].older = neg->head;
+
+	if (neg->head != NIL) {
+		nent[neg->head].newer = i;
+	} else {
+		neg->tail = i;
+	}
+
+	neg->head = i;
+}
+
+/* Unused entries go last, to be taken first. */
+static void
+lrutail(uint32_t i)
+{
+	lrudel(i);
+	nent[i].older = NIL;
+	nent[i].newer = neg->tail;
+
+	if (neg->tail != NIL) {
+		nent[neg->tail].older = i;
+	} else {
+		neg->head = i;
+	}
+
+	neg->tail = i;
+}
+
+static void
+prefork(void)
+{
+	(void)pthread_mutex_lock(&lock);
+}
+
+static void
+postfork(void)
+{
+	(void)pthread_mutex_unlock(&lock);
+}
+
+static void *
+watcher(void *arg)
+{
+#ifdef __linux__
+	_Alignas(struct inotify_event) char buf[EV_LEN];
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+#endif
+
+	(void)arg;
+
+	if (stale) {
+		crawl();
+	}
+
+#ifdef __linux__
+	if (nfd == -1) {
+		return NULL;
+	}
+
+	/* Every indexed directory is watched now. */
+	(void)pthread_mutex_lock(&lock);
+	negon(!wfull);
+	(void)pthread_mutex_unlock(&lock);
+
+	while ((n = read(nfd, buf, EV_LEN)) != 0) {
+		if (n == -1) {
+			if (errno != EINTR) {
+				warn("index: inotify read");
+				break;
+			}
+			continue;
+		}
+
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)p;
+			event(ev);
+		}
+	}
+#endif
+
+	return NULL;
+}
+
+#ifdef __linux__
+/* Watch a directory so changes below it reach the index. Called with the
+ * lock held. Watches are limited by fs.inotify.max_user_watches; past it,
+ * entries are only corrected when requests find them stale. */
+static void
+addwatch(const char *dir)
+{
+	char path[PATH_MAX];
+	char **p;
+	size_t n;
+	int wd;
+
+	if (nfd == -1 || wfull || abspath(path, dir) == -1) {
+		return;
+	}
+
+	if ((wd = inotify_add_watch(nfd, path, EV_MASK)) == -1) {
+		if (errno == ENOSPC) {
+			warnx("index: out of inotify watches");
+			wfull = 1;
+			negon(0);
+		}
+		return;
+	}
+
+	if ((size_t)wd >= nwatch) {
+		n = (size_t)wd + 1 > 2 * nwatch ? (size_t)wd + 1 : 2 * nwatch;
+
+		if ((p = reallocarray(watch, n, sizeof(*watch))) == NULL) {
+			wfull = 1;
+			negon(0);
+			return;
+		}
+
+		(void)memset(p + nwatch, 0, (n - nwatch) * sizeof(*watch));
+		watch = p;
+		nwatch = n;
+	}
+
+	/* A renamed directory keeps its descriptor. */
+	free(watch[wd]);
+
+	if ((watch[wd] = strdup(dir)) == NULL) {
+		wfull = 1;
+		negon(0);
+	}
+}
+
+/* Stop watching dir and everything below it, which was moved away. Called
+ * with the lock held. */
+static void
+unwatch(const char *dir)
+{
+	size_t i, len;
+
+	len = strlen(dir);
+
+	for (i = 0; i < nwatch; i++) {
+		if (watch[i] != NULL && strncmp(watch[i], dir, len) == 0
+			&& (watch[i][len] == '\0' || watch[i][len] == '/')) {
+			(void)inotify_rm_watch(nfd, (int)i);
+			free(watch[i]);
+			watch[i] = NULL;
+		}
+	}
+}
+
+static void
+event(struct inotify_event *ev)
+{
+	static int overflow;
+	char key[PATH_MAX];
+	char path[PATH_MAX];
+	struct stat st;
+	size_t i;
+	int gone, moved;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		if (!overflow) {
+			warnx("index: inotify queue overflow");
+			overflow = 1;
+		}
+
+		/* Creations were lost. */
+		if (neg != NULL && nlock(1) == 0) {
+			negflush();
+			(void)pthread_mutex_unlock(&neg->lock);
+		}
+		return;
+	}
+
+	(void)pthread_mutex_lock(&lock);
+
+	if (ev->wd < 0 || (size_t)ev->wd >= nwatch || watch[ev->wd] == NULL) {
+		(void)pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED) {
+		free(watch[ev->wd]);
+		watch[ev->wd] = NULL;
+		(void)pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	if (ev->len == 0 || join(key, watch[ev->wd], ev->name) == -1) {
+		(void)pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	/* Watches below a moved directory still carry its old name. They're
+	 * dropped, and set up again under the new one when it's crawled. */
+	moved = (ev->mask & IN_MOVED_FROM) && (ev->mask & IN_ISDIR);
+	if (moved) {
+		unwatch(key);
+	}
+
+	(void)pthread_mutex_unlock(&lock);
+
+	if (moved || ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+		negcreate(key);
+	}
+
+	gone = (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		|| abspath(path, key) == -1
+		|| fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) == -1;
+
+	(void)pthread_mutex_lock(&lock);
+
+	if (gone || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
+		if (tab[i = find(hash(key))].hash != 0) {
+			delete(i);
+		}
+	} else {
+		/* Watched before it is indexed, so nothing is remembered
+		 * missing below it while creations there go unseen. */
+		if (S_ISDIR(st.st_mode)) {
+			addwatch(key);
+		}
+
+		insert(hash(key), &st, ev->mask & IN_CLOSE_WRITE ? 0 : KEEP, 1);
+
+		/* Nothing below a directory moved in is watched yet. */
+		if (S_ISDIR(st.st_mode) && ev->mask & IN_MOVED_TO
+			&& push("", key) == 0) {
+			(void)pthread_mutex_unlock(&lock);
+			(void)crawler(NULL);
+			return;
+		}
+	}
+
+	(void)pthread_mutex_unlock(&lock);
+}
+#endif
@@ -0,0 +1,245 @@
+/*
+ * mkpack builds a pack of the files under a directory for filesrv -k.
+ * Copyright (C) 2020 Esote
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define USAGE		"usage: %s dir pack\n"
+#define READ_LEN	(64 << 10)
+
+static char **	names;
+static size_t	nnames, capnames;
+
+static void	walk(const char *);
+static void	add(char *);
+static void	body(FILE *, const char *, struct packent *);
+static int	namecmp(const void *, const void *);
+
+int
+main(int argc, char *argv[])
+{
+	char tmp[PATH_MAX];
+	struct packhdr hdr;
+	struct packent *ents;
+	FILE *f;
+	uint64_t off;
+	size_t i;
+	int cwd;
+	int n;
+
+	if (argc != 3) {
+		(void)fprintf(stderr, USAGE, argv[0]);
+		return 1;
+	}
+
+	n = snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+
+	if (n < 0 || (size_t)n >= sizeof(tmp)) {
+		errx(1, "pack path too long");
+	}
+
+	/* Written beside the pack and renamed over it, so a running filesrv
+	 * keeps its mapping of the old one. */
+	if ((f = fopen(tmp, "w")) == NULL) {
+		err(1, "fopen %s", tmp);
+	}
+
+	if ((cwd = open(".", O_RDONLY | O_DIRECTORY)) == -1) {
+		err(1, "open .");
+	}
+
+	if (chdir(argv[1]) == -1) {
+		err(1, "chdir %s", argv[1]);
+	}
+
+	walk("");
+	qsort(names, nnames, sizeof(*names), namecmp);
+
+	if ((ents = calloc(nnames != 0 ? nnames : 1, sizeof(*ents))) == NULL) {
+		err(1, "calloc");
+	}
+
+	/* Names after the entries, then the bodies. */
+	off = sizeof(hdr) + nnames * sizeof(*ents);
+
+	if (fseeko(f, (off_t)off, SEEK_SET) == -1) {
+		err(1, "fseeko");
+	}
+
+	for (i = 0; i < nnames; i++) {
+		ents[i].name = off;
+		off += strlen(names[i]) + 1;
+
+		if (fwrite(names[i], strlen(names[i]) + 1, 1, f) != 1) {
+			err(1, "fwrite %s", tmp);
+		}
+	}
+
+	for (i = 0; i < nnames; i++) {
+		body(f, names[i], &ents[i]);
+	}
+
+	(void)memset(&hdr, 0, sizeof(hdr));
+	(void)memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+	hdr.n = nnames;
+
+	if (fseeko(f, 0, SEEK_SET) == -1
+		|| fwrite(&hdr, sizeof(hdr), 1, f) != 1
+		|| (nnames != 0 && fwrite(ents, sizeof(*ents), nnames, f)
+		!= nnames) || fflush(f) == EOF || fsync(fileno(f)) == -1
+		|| fclose(f) == EOF) {
+		err(1, "write %s", tmp);
+	}
+
+	if (renameat(cwd, tmp, cwd, argv[2]) == -1) {
+		err(1, "rename %s", tmp);
+	}
+
+	return 0;
+}
+
+/* Collect the regular files under dir, relative to the top. Links are left
+ * out, as filesrv leaves them out of archives. */
+static void
+walk(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	DIR *d;
+	int n;
+
+	if ((d = opendir(*dir != '\0' ? dir : ".")) == NULL) {
+		err(1, "opendir %s", *dir != '\0' ? dir : ".");
+	}
+
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0
+			|| strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		n = snprintf(path, sizeof(path), "%s%s%s", dir,
+			*dir != '\0' ? "/" : "", ent->d_name);
+
+		if (n < 0 || (size_t)n >= sizeof(path)) {
+			warnx("%s/%s: path too long", dir, ent->d_name);
+			continue;
+		}
+
+		if (lstat(path, &st) == -1) {
+			err(1, "lstat %s", path);
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			walk(path);
+		} else if (S_ISREG(st.st_mode)) {
+			add(path);
+		}
+	}
+
+	(void)closedir(d);
+}
+
+static void
+add(char *path)
+{
+	char **p;
+	size_t n;
+
+	if (nnames == capnames) {
+		n = capnames != 0 ? 2 * capnames : 1024;
+
+		if ((p = reallocarray(names, n, sizeof(*names))) == NULL) {
+			err(1, "reallocarray");
+		}
+
+		names = p;
+		capnames = n;
+	}
+
+	if ((names[nnames++] = strdup(path)) == NULL) {
+		err(1, "strdup");
+	}
+}
+
+/* Append the body of the file name to the pack and fill in the rest of its
+ * entry. */
+static void
+body(FILE *f, const char *name, struct packent *e)
+{
+	uint8_t buf[READ_LEN];
+	struct sha256 sha;
+	struct stat st;
+	ssize_t n;
+	char *mime;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY | O_NOFOLLOW)) == -1) {
+		err(1, "open %s", name);
+	}
+
+	if (fstat(fd, &st) == -1) {
+		err(1, "fstat %s", name);
+	}
+
+	mime = sniff(fd, (char *)name);
+
+	(void)strncpy(e->mime, mime, MIME_LEN - 1);
+	e->off = (uint64_t)ftello(f);
+	e->sec = (int64_t)st.st_mtim.tv_sec;
+	e->nsec = (int64_t)st.st_mtim.tv_nsec;
+
+	sha256_init(&sha);
+
+	/* The size is what was read, in case the file changed meanwhile. */
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		sha256_update(&sha, buf, (size_t)n);
+
+		if (fwrite(buf, (size_t)n, 1, f) != 1) {
+			err(1, "fwrite");
+		}
+
+		e->size += (uint64_t)n;
+	}
+
+	if (n == -1) {
+		err(1, "read %s", name);
+	}
+
+	sha256_final(&sha, e->md);
+	(void)close(fd);
+}
+
+static int
+namecmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
@@ -0,0 +1,374 @@
+/* Filesystem steps of requests that miss the index, run on a bounded pool of
+ * threads. Requests are still served one at a time, but the server waits for
+ * the steps only up to a deadline: a path on a cold or stuck disk gets a 503
+ * while its steps finish in the background, warming the caches for the
+ * retry, instead of stalling every connection queued behind it. Completions
+ * are signalled on an eventfd, or a pipe elsewhere. Index hits never get
+ * here. */
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define DEPTH	64	/* jobs queued or running, abandoned ones included */
+
+enum {
+	FREE,
+	QUEUED,
+	RUNNING,
+	DONE
+};
+
+struct job {
+	int	 state;
+	int	 abandoned;	/* timed out; the thread cleans up */
+	char	 in[PATH_MAX];
+	char	 out[PATH_MAX];
+	struct fsop op;
+};
+
+struct stats {
+	uint64_t jobs;
+	uint64_t late;		/* answered 503 after the deadline */
+	uint64_t full;		/* answered 503 with every thread stuck */
+	uint64_t wait;		/* total wait of jobs waited for, us */
+	uint64_t maxwait;
+	int	 depth;
+	int	 maxdepth;
+	int	 stuck;		/* threads still on abandoned jobs */
+};
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	cond = PTHREAD_COND_INITIALIZER;
+static struct job	jobs[DEPTH];
+static struct stats	stats;
+static int		nthreads;
+static int		deadline;	/* ms */
+static int		efd[2] = { -1, -1 };
+
+static void *	worker(void *);
+static void	run(struct job *);
+static void	wake(void);
+static void	drain(void);
+static uint64_t	usec(void);
+static void *	reporter(void *);
+
+/* Start nthreads threads that give up on steps after ms milliseconds. With
+ * report set, SIGUSR2 logs the pool's counters; call before other threads
+ * start, so they inherit its signal mask. */
+void
+offloadinit(int n, int ms, int report)
+{
+	sigset_t set;
+	pthread_t t;
+	int i;
+
+	if (n == 0) {
+		return;
+	}
+
+#ifdef __linux__
+	if ((efd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		err(1, "eventfd");
+	}
+
+	efd[1] = efd[0];
+#else
+	if (pipe(efd) == -1) {
+		err(1, "pipe");
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (fcntl(efd[i], F_SETFL, O_NONBLOCK) == -1
+			|| fcntl(efd[i], F_SETFD, FD_CLOEXEC) == -1) {
+			err(1, "fcntl");
+		}
+	}
+#endif
+
+	deadline = ms;
+
+	if (report) {
+		(void)sigemptyset(&set);
+		(void)sigaddset(&set, SIGUSR2);
+
+		if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0) {
+			err(1, "pthread_sigmask");
+		}
+
+		if ((errno = pthread_create(&t, NULL, reporter, NULL)) != 0) {
+			err(1, "pthread_create");
+		}
+
+		(void)pthread_detach(t);
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((errno = pthread_create(&t, NULL, worker, NULL)) != 0) {
+			err(1, "pthread_create");
+		}
+
+		(void)pthread_detach(t);
+	}
+
+	nthreads = n;
+}
+
+/* Resolve path into resolved, which holds PATH_MAX bytes, and stat it; a
+ * regular file is also opened and sniffed. Returns 0 with op filled in, 1 if
+ * there is no pool and the caller must take the steps itself, or -1 if the
+ * steps didn't finish in time or the pool is full. */
+int
+offload(const char *path, char *resolved, struct fsop *op)
+{
+	struct pollfd pfd;
+	struct job *j;
+	uint64_t start, waited;
+	int ms;
+
+	if (nthreads == 0) {
+		return 1;
+	}
+
+	if (strlen(path) >= PATH_MAX) {
+		op->step = FS_RESOLVE;
+		op->err = ENAMETOOLONG;
+		return 0;
+	}
+
+	(void)pthread_mutex_lock(&lock);
+
+	for (j = jobs; j < jobs + DEPTH && j->state != FREE; j++) {
+	}
+
+	/* With every thread stuck, say on a dead network mount, the job
+	 * would only wait out the deadline. */
+	if (j == jobs + DEPTH || stats.stuck == nthreads) {
+		stats.full++;
+		(void)pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	j->state = QUEUED;
+	j->abandoned = 0;
+	(void)memcpy(j->in, path, strlen(path) + 1);
+
+	stats.jobs++;
+	if (++stats.depth > stats.maxdepth) {
+		stats.maxdepth = stats.depth;
+	}
+
+	(void)pthread_cond_signal(&cond);
+	(void)pthread_mutex_unlock(&lock);
+
+	start = usec();
+	pfd.fd = efd[0];
+	pfd.events = POLLIN;
+
+	while (1) {
+		(void)pthread_mutex_lock(&lock);
+
+		waited = usec() - start;
+
+		if (j->state == DONE) {
+			break;
+		}
+
+		if ((ms = deadline - (int)(waited / 1000)) <= 0) {
+			/* Steps already under way finish to warm the caches;
+			 * the rest are dropped so they don't hold up others. */
+			if (j->state == QUEUED) {
+				j->state = FREE;
+				stats.depth--;
+			} else {
+				j->abandoned = 1;
+				stats.stuck++;
+			}
+
+			stats.late++;
+			(void)pthread_mutex_unlock(&lock);
+			return -1;
+		}
+
+		(void)pthread_mutex_unlock(&lock);
+
+		/* Other jobs finishing wake this too. */
+		(void)poll(&pfd, 1, ms);
+		drain();
+	}
+
+	*op = j->op;
+	(void)memcpy(resolved, j->out, strlen(j->out) + 1);
+
+	j->state = FREE;
+	stats.depth--;
+	stats.wait += waited;
+	if (waited > stats.maxwait) {
+		stats.maxwait = waited;
+	}
+
+	(void)pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/* Log the pool's counters. */
+void
+offloadlog(void)
+{
+	struct stats s;
+
+	if (nthreads == 0) {
+		return;
+	}
+
+	(void)pthread_mutex_lock(&lock);
+	s = stats;
+	(void)pthread_mutex_unlock(&lock);
+
+	warnx("offload: %ju jobs, %ju late, %ju full, depth %d, max %d, "
+		"%d stuck, wait mean %.3f ms, max %.3f ms", (uintmax_t)s.jobs,
+		(uintmax_t)s.late, (uintmax_t)s.full, s.depth, s.maxdepth,
+		s.stuck,
+		s.jobs > s.late ? (double)s.wait / 1e3
+		/ (double)(s.jobs - s.late) : 0.0, (double)s.maxwait / 1e3);
+}
+
+static void *
+worker(void *arg)
+{
+	struct job *j;
+
+	(void)arg;
+
+	(void)pthread_mutex_lock(&lock);
+
+	while (1) {
+		for (j = jobs; j < jobs + DEPTH && j->state != QUEUED; j++) {
+		}
+
+		if (j == jobs + DEPTH) {
+			(void)pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		j->state = RUNNING;
+		(void)pthread_mutex_unlock(&lock);
+
+		run(j);
+
+		(void)pthread_mutex_lock(&lock);
+
+		if (j->abandoned) {
+			if (j->op.fd != -1) {
+				(void)close(j->op.fd);
+			}
+
+			j->state = FREE;
+			stats.depth--;
+			stats.stuck--;
+		} else {
+			j->state = DONE;
+			wake();
+		}
+	}
+
+	return NULL;
+}
+
+static void
+run(struct job *j)
+{
+	struct fsop *op;
+
+	op = &j->op;
+	op->step = FS_RESOLVE;
+	op->fd = -1;
+	op->mime = NULL;
+
+	if (realpath(j->in, j->out) == NULL) {
+		op->err = errno;
+		return;
+	}
+
+	op->step = FS_STAT;
+
+	if (stat(j->out, &op->st) == -1) {
+		op->err = errno;
+		return;
+	}
+
+	op->step = FS_DONE;
+	op->err = 0;
+
+	/* Failures are left for the caller to report when it opens. */
+	if (S_ISREG(op->st.st_mode)
+		&& (op->fd = open(j->out, O_RDONLY | O_CLOEXEC)) != -1) {
+		op->mime = sniff(op->fd, j->out);
+	}
+}
+
+static void
+wake(void)
+{
+	uint64_t one;
+
+	one = 1;
+
+	/* A full pipe already wakes the waiter. */
+	while (write(efd[1], &one, sizeof(one)) == -1 && errno == EINTR) {
+	}
+}
+
+static void
+drain(void)
+{
+	uint64_t buf[8];
+
+	while (read(efd[0], buf, sizeof(buf)) > 0) {
+	}
+}
+
+static uint64_t
+usec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Log the counters on SIGUSR2, when not a worker. */
+static void *
+reporter(void *arg)
+{
+	sigset_t set;
+	int sig;
+
+	(void)arg;
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGUSR2);
+
+	while (1) {
+		if (sigwait(&set, &sig) == 0) {
+			offloadlog();
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,182 @@
+/* Packs of many small files, built by mkpack and mounted at a request path
+ * prefix. A pack is mapped read-only and its entries found by binary search
+ * on name, so serving one takes no path resolution, open or close, and the
+ * body is written straight from the mapping. */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define PACK_MAX	16
+
+struct pack {
+	char	*prefix;	/* without a trailing slash */
+	size_t	 len;
+	const char *base;
+	size_t	 size;
+	const struct packent *ents;
+	size_t	 n;
+};
+
+static struct pack	packs[PACK_MAX];
+static size_t		npacks;
+
+static void	check(const struct pack *, const char *);
+
+/* Parse and mount prefix:file, before chroot. */
+void
+packmount(char *arg)
+{
+	const struct packhdr *hdr;
+	struct pack *p;
+	struct stat st;
+	char *file;
+	void *m;
+	int fd;
+
+	if (npacks == PACK_MAX) {
+		errx(1, "too many packs");
+	}
+
+	if ((file = strrchr(arg, ':')) == NULL) {
+		errx(1, "pack %s: no prefix", arg);
+	}
+
+	*file++ = '\0';
+
+	p = &packs[npacks++];
+	p->prefix = arg;
+	p->len = strlen(arg);
+
+	while (p->len > 0 && arg[p->len-1] == '/') {
+		arg[--p->len] = '\0';
+	}
+
+	/* It would hide the rest of the tree behind 404s. */
+	if (p->len == 0) {
+		errx(1, "pack %s: prefix is the whole tree", file);
+	}
+
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		err(1, "pack: open %s", file);
+	}
+
+	if (fstat(fd, &st) == -1) {
+		err(1, "pack: fstat %s", file);
+	}
+
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		errx(1, "pack %s: truncated", file);
+	}
+
+	/* The mapping outlives the descriptor, so nothing is left open in the
+	 * served directory or across daemonizing. */
+	if ((m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+		== MAP_FAILED) {
+		err(1, "pack: mmap %s", file);
+	}
+
+	(void)close(fd);
+
+	hdr = m;
+	p->base = m;
+	p->size = (size_t)st.st_size;
+	p->ents = (const struct packent *)(hdr + 1);
+	p->n = (size_t)hdr->n;
+
+	if (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) != 0) {
+		errx(1, "pack %s: not a pack", file);
+	}
+
+	if (hdr->n > (p->size - sizeof(*hdr)) / sizeof(*p->ents)) {
+		errx(1, "pack %s: truncated", file);
+	}
+
+	check(p, file);
+
+	/* Lookups touch the entries at random. */
+	(void)posix_madvise((void *)p->base, sizeof(*hdr) + p->n
+		* sizeof(*p->ents), POSIX_MADV_WILLNEED);
+}
+
+/* Find the request path in the packs. Returns 0 and fills in f if found, -1
+ * if no pack is mounted above path, or -2 if one is but has no such entry. */
+int
+packget(const char *path, struct packfile *f)
+{
+	const struct packent *e;
+	struct pack *p;
+	size_t i, lo, hi, mid;
+	int cmp;
+
+	for (i = 0; i < npacks; i++) {
+		p = &packs[i];
+
+		if (strncmp(path, p->prefix, p->len) == 0
+			&& path[p->len] == '/') {
+			break;
+		}
+	}
+
+	if (i == npacks) {
+		return -1;
+	}
+
+	path += p->len + 1;
+	lo = 0;
+	hi = p->n;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &p->ents[mid];
+
+		if ((cmp = strcmp(path, p->base + e->name)) == 0) {
+			f->body = p->base + e->off;
+			f->ent = e;
+			return 0;
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return -2;
+}
+
+/* Refuse packs whose entries point outside the file or aren't sorted, so
+ * requests never have to check. */
+static void
+check(const struct pack *p, const char *file)
+{
+	const struct packent *e;
+	const char *prev;
+	size_t i;
+
+	prev = NULL;
+
+	for (i = 0; i < p->n; i++) {
+		e = &p->ents[i];
+
+		if (e->name >= p->size || memchr(p->base + e->name, '\0',
+			p->size - e->name) == NULL || e->off > p->size
+			|| e->size > p->size - e->off
+			|| memchr(e->mime, '\0', MIME_LEN) == NULL) {
+			errx(1, "pack %s: entry %zu corrupt", file, i);
+		}
+
+		if (prev != NULL && strcmp(prev, p->base + e->name) >= 0) {
+			errx(1, "pack %s: entries not sorted", file);
+		}
+
+		prev = p->base + e->name;
+	}
+}
@@ -0,0 +1,502 @@
+/* Sampling profiler for the thread serving requests. SIGUSR1 starts a window
+ * of samples taken on its CPU time, after which the stacks are written out
+ * folded, one line per distinct stack with its count, as flamegraph.pl and
+ * similar tools take them. */
+
+#define _GNU_SOURCE /* dladdr(), dl_iterate_phdr() */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <err.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define HZ		99	/* off the beat of anything periodic */
+#define DEPTH		64
+#define SKIP		2	/* the handler and the signal trampoline */
+#define WINDOW_DEFAULT	10
+#define LINE_LEN	8192
+
+#ifdef __linux__
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id	_sigev_un._tid
+#endif
+#endif
+
+struct sym {
+	uintptr_t	 addr;
+	size_t		 size;
+	const char	*name;
+};
+
+static int		out = -1;
+static unsigned long	window = WINDOW_DEFAULT;
+static struct sym *	syms;
+static size_t		nsyms;
+static uintptr_t	bias;
+static uintptr_t	lo, hi;	/* mapped extent of the executable */
+
+/* Samples of the current window. */
+static void **		stacks;
+static int *		depths;
+static size_t		maxsamp;
+static atomic_size_t	nsamp;
+
+#ifdef __linux__
+static timer_t		timer;
+#endif
+
+static void *	profiler(void *);
+static void	record(void);
+static int	arm(int);
+static void	sample(int);
+static void	dump(size_t);
+static size_t	frame(char *, size_t, void *, int);
+static void	loadsyms(void);
+#ifdef __linux__
+static int	phdr(struct dl_phdr_info *, size_t, void *);
+#endif
+static int	symcmp(const void *, const void *);
+static int	strpcmp(const void *, const void *);
+
+/* Set up profiling to [seconds:]file, which is opened now since it may be
+ * outside the chroot. Returns its descriptor. */
+int
+profinit(char *arg)
+{
+	void *pc;
+	char *file, *end;
+
+	file = arg;
+
+	if ((end = strchr(arg, ':')) != NULL) {
+		*end = '\0';
+		window = strtoul(arg, &file, 10);
+
+		if (file == arg || *file != '\0' || window == 0
+			|| window > 3600) {
+			errx(1, "invalid profile window '%s'", arg);
+		}
+
+		file = end + 1;
+	}
+
+	if ((out = open(file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		err(1, "open %s", file);
+	}
+
+	loadsyms();
+
+	/* The first call loads the unwinder, which isn't safe in a handler. */
+	(void)backtrace(&pc, 1);
+
+	return out;
+}
+
+/* Start waiting for SIGUSR1. Must be called from the thread serving
+ * requests, after the last fork() and before any other thread is created,
+ * so that they all inherit SIGUSR1 blocked. */
+void
+profstart(void)
+{
+	struct sigaction act;
+	sigset_t set;
+	pthread_t t;
+#ifdef __linux__
+	struct sigevent sev;
+	clockid_t clk;
+#endif
+
+	if (out == -1) {
+		return;
+	}
+
+	(void)memset(&act, 0, sizeof(act));
+	(void)sigemptyset(&act.sa_mask);
+	act.sa_handler = sample;
+	act.sa_flags = SA_RESTART;
+
+	if (sigaction(SIGPROF, &act, NULL) == -1) {
+		err(1, "sigaction SIGPROF");
+	}
+
+#ifdef __linux__
+	/* Ticks of this thread's CPU clock only, so an idle server isn't
+	 * interrupted and other threads don't show up as its samples. */
+	if ((errno = pthread_getcpuclockid(pthread_self(), &clk)) != 0) {
+		err(1, "pthread_getcpuclockid");
+	}
+
+	(void)memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = gettid();
+
+	if (timer_create(clk, &sev, &timer) == -1) {
+		err(1, "timer_create");
+	}
+#endif
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGUSR1);
+
+	if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0) {
+		err(1, "pthread_sigmask");
+	}
+
+	if ((errno = pthread_create(&t, NULL, profiler, NULL)) != 0) {
+		err(1, "pthread_create");
+	}
+
+	(void)pthread_detach(t);
+}
+
+static void *
+profiler(void *arg)
+{
+	sigset_t set;
+	int sig;
+
+	(void)arg;
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGUSR1);
+
+	while (1) {
+		if (sigwait(&set, &sig) == 0) {
+			record();
+		}
+	}
+
+	return NULL;
+}
+
+static void
+record(void)
+{
+	struct timespec ts;
+
+	maxsamp = window * HZ;
+
+	if ((stacks = calloc(maxsamp, DEPTH * sizeof(*stacks))) == NULL
+		|| (depths = calloc(maxsamp, sizeof(*depths))) == NULL) {
+		warn("profile: calloc");
+		goto done;
+	}
+
+	atomic_store(&nsamp, 0);
+
+	if (arm(1) == -1) {
+		warn("profile: arm");
+		goto done;
+	}
+
+	ts.tv_sec = (time_t)window;
+	ts.tv_nsec = 0;
+
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+	}
+
+	if (arm(0) == -1) {
+		warn("profile: disarm");
+	}
+
+	/* Let a sample already being taken finish. */
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	(void)nanosleep(&ts, NULL);
+
+	dump(atomic_load(&nsamp) < maxsamp ? atomic_load(&nsamp) : maxsamp);
+
+done:
+	free(stacks);
+	free(depths);
+	stacks = NULL;
+	depths = NULL;
+}
+
+static int
+arm(int on)
+{
+#ifdef __linux__
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = on ? 1000000000 / HZ : 0;
+	its.it_value = its.it_interval;
+
+	return timer_settime(timer, 0, &its, NULL);
+#else
+	struct itimerval itv;
+
+	itv.it_interval.tv_sec = 0;
+	itv.it_interval.tv_usec = on ? 1000000 / HZ : 0;
+	itv.it_value = itv.it_interval;
+
+	return setitimer(ITIMER_PROF, &itv, NULL);
+#endif
+}
+
+static void
+sample(int sig)
+{
+	size_t i;
+	int saved;
+
+	(void)sig;
+
+	saved = errno;
+
+	if (stacks != NULL && (i = atomic_fetch_add(&nsamp, 1)) < maxsamp) {
+		depths[i] = backtrace(stacks + i * DEPTH, DEPTH);
+	}
+
+	errno = saved;
+}
+
+/* Write the samples folded, root first, truncating the previous window's. */
+static void
+dump(size_t n)
+{
+	char line[LINE_LEN];
+	char **lines;
+	size_t i, j, k, len, count;
+	int d;
+
+	if ((lines = calloc(n + 1, sizeof(*lines))) == NULL) {
+		warn("profile: calloc");
+		return;
+	}
+
+	for (i = 0, k = 0; i < n; i++) {
+		for (d = depths[i] - 1, len = 0; d >= SKIP; d--) {
+			len += frame(line + len, LINE_LEN - len,
+				stacks[i * DEPTH + (size_t)d], d > SKIP);
+
+			if (d > SKIP && len < LINE_LEN - 1) {
+				line[len++] = ';';
+				line[len] = '\0';
+			}
+		}
+
+		if (len != 0 && (lines[k] = strdup(line)) != NULL) {
+			k++;
+		}
+	}
+
+	qsort(lines, k, sizeof(*lines), strpcmp);
+
+	if (ftruncate(out, 0) == -1 || lseek(out, 0, SEEK_SET) == -1) {
+		warn("profile: truncate");
+	}
+
+	for (i = 0; i < k; i = j) {
+		for (j = i + 1; j < k && strcmp(lines[i], lines[j]) == 0; j++) {
+		}
+
+		count = j - i;
+
+		if (dprintf(out, "%s %zu\n", lines[i], count) < 0) {
+			warn("profile: write");
+			break;
+		}
+	}
+
+	warnx("profile: %zu samples", k);
+
+	for (i = 0; i < k; i++) {
+		free(lines[i]);
+	}
+
+	free(lines);
+}
+
+/* Name the function containing pc into buf. Frames above the interrupted
+ * one hold return addresses, which may already be past the call. */
+static size_t
+frame(char *buf, size_t len, void *pc, int ret)
+{
+	struct sym *s;
+	Dl_info info;
+	uintptr_t a, off;
+	size_t l, h, m;
+	int n;
+
+	a = (uintptr_t)pc - (ret ? 1 : 0);
+	off = a - bias;
+	s = NULL;
+
+	if (nsyms != 0 && a >= lo && a < hi && off >= syms[0].addr) {
+		/* Last symbol at or below the address. */
+		for (l = 0, h = nsyms; h - l > 1;) {
+			m = l + (h - l) / 2;
+
+			if (syms[m].addr <= off) {
+				l = m;
+			} else {
+				h = m;
+			}
+		}
+
+		if (off < syms[l].addr + syms[l].size) {
+			s = &syms[l];
+		}
+	}
+
+	if (s != NULL) {
+		n = snprintf(buf, len, "%s", s->name);
+	} else if (dladdr((void *)a, &info) != 0 && info.dli_sname != NULL) {
+		n = snprintf(buf, len, "%s", info.dli_sname);
+	} else {
+		n = snprintf(buf, len, "%#jx", (uintmax_t)a);
+	}
+
+	if (n < 0) {
+		return 0;
+	}
+
+	return (size_t)n < len ? (size_t)n : len - 1;
+}
+
+/* Most functions are static, so dladdr() can't name them; read the symbol
+ * table of the executable instead. It stays mapped for the names. */
+static void
+loadsyms(void)
+{
+#ifdef __linux__
+	ElfW(Ehdr) *eh;
+	ElfW(Shdr) *sh;
+	ElfW(Sym) *sym;
+	struct stat st;
+	const char *str;
+	uint8_t *p;
+	size_t i, j, n, strsize;
+	int fd;
+
+	if ((fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC)) == -1) {
+		return;
+	}
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*eh)
+		|| (p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+		fd, 0)) == MAP_FAILED) {
+		(void)close(fd);
+		return;
+	}
+
+	(void)close(fd);
+
+	eh = (ElfW(Ehdr) *)p;
+
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0
+		|| eh->e_shoff + (size_t)eh->e_shnum * sizeof(*sh)
+		> (size_t)st.st_size) {
+		return;
+	}
+
+	sh = (ElfW(Shdr) *)(p + eh->e_shoff);
+
+	for (i = 0; i < eh->e_shnum; i++) {
+		if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum
+			|| sh[i].sh_offset + sh[i].sh_size > (size_t)st.st_size
+			|| sh[sh[i].sh_link].sh_offset
+			+ sh[sh[i].sh_link].sh_size > (size_t)st.st_size) {
+			continue;
+		}
+
+		sym = (ElfW(Sym) *)(p + sh[i].sh_offset);
+		n = sh[i].sh_size / sizeof(*sym);
+		str = (const char *)(p + sh[sh[i].sh_link].sh_offset);
+		strsize = sh[sh[i].sh_link].sh_size;
+
+		if ((syms = calloc(n, sizeof(*syms))) == NULL) {
+			return;
+		}
+
+		for (j = 0; j < n; j++) {
+			if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC
+				|| sym[j].st_value == 0
+				|| sym[j].st_name >= strsize) {
+				continue;
+			}
+
+			syms[nsyms].addr = (uintptr_t)sym[j].st_value;
+			syms[nsyms].size = (size_t)sym[j].st_size;
+			syms[nsyms].name = str + sym[j].st_name;
+			nsyms++;
+		}
+
+		break;
+	}
+
+	qsort(syms, nsyms, sizeof(*syms), symcmp);
+
+	/* Where a position independent executable was loaded. */
+	(void)dl_iterate_phdr(phdr, NULL);
+#endif
+}
+
+#ifdef __linux__
+static int
+phdr(struct dl_phdr_info *info, size_t size, void *arg)
+{
+	uintptr_t start, end;
+	int i;
+
+	(void)size;
+	(void)arg;
+
+	/* The executable comes first. */
+	bias = (uintptr_t)info->dlpi_addr;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		if (info->dlpi_phdr[i].p_type != PT_LOAD) {
+			continue;
+		}
+
+		start = bias + (uintptr_t)info->dlpi_phdr[i].p_vaddr;
+		end = start + (uintptr_t)info->dlpi_phdr[i].p_memsz;
+
+		if (lo == 0 || start < lo) {
+			lo = start;
+		}
+		if (end > hi) {
+			hi = end;
+		}
+	}
+
+	return 1;
+}
+#endif
+
+static int
+symcmp(const void *a, const void *b)
+{
+	const struct sym *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static int
+strpcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
@@ -0,0 +1,453 @@
+/*
+ * replay plays a filesrv request trace back against a server.
+ * Copyright (C) 2020 Esote
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define USAGE		"usage: %s [-c conns] [-s speed] trace host port\n"
+#define CONNS_DEFAULT	16
+#define BUF_LEN		(64 << 10)
+#define SMALL		(64 << 10)	/* bodies below are small files */
+#define LATE		10000000	/* ns behind schedule to count as late */
+
+/* Path classes, by what the response was. */
+enum {
+	C_SMALL,
+	C_LARGE,
+	C_DIR,
+	C_TAR,
+	C_404,
+	C_503,
+	C_OTHER,
+	C_ERROR,
+	C_MAX
+};
+
+static const char *classes[C_MAX] = {
+	"file <64K", "file >=64K", "dir", "tar", "404", "503", "other",
+	"error"
+};
+
+struct req {
+	uint64_t at;		/* ns after the first request */
+	int	 head;
+	char	*path;
+	char	*host;		/* NULL without a Host header */
+	uint64_t lat;		/* ns */
+	int	 cls;
+	int	 late;
+};
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static struct req *	reqs;
+static size_t		nreqs, next;
+static struct addrinfo *addr;
+static uint64_t		start;
+static double		speed;
+
+static void	load(const char *);
+static void *	player(void *);
+static void	play(struct req *);
+static int	classify(const struct req *, int, size_t);
+static void	report(void);
+static int	atcmp(const void *, const void *);
+static int	latcmp(const void *, const void *);
+static uint64_t	nsec(void);
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	pthread_t *t;
+	char *end;
+	long conns;
+	int ch, i;
+
+	conns = CONNS_DEFAULT;
+	speed = 1;
+
+	while ((ch = getopt(argc, argv, "c:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			conns = strtol(optarg, &end, 10);
+
+			if (*end != '\0' || conns < 1 || conns > 4096) {
+				errx(1, "conns invalid");
+			}
+			break;
+		case 's':
+			speed = strtod(optarg, &end);
+
+			if (*end != '\0' || speed < 0) {
+				errx(1, "speed invalid");
+			}
+			break;
+		default:
+			(void)fprintf(stderr, USAGE, argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 3) {
+		(void)fprintf(stderr, USAGE, argv[0]);
+		return 1;
+	}
+
+	argv += optind;
+
+	load(argv[0]);
+
+	(void)memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((i = getaddrinfo(argv[1], argv[2], &hints, &addr)) != 0) {
+		errx(1, "%s: %s", argv[1], gai_strerror(i));
+	}
+
+	if ((t = calloc((size_t)conns, sizeof(*t))) == NULL) {
+		err(1, "calloc");
+	}
+
+	start = nsec();
+
+	for (i = 0; i < conns; i++) {
+		if ((errno = pthread_create(&t[i], NULL, player, NULL)) != 0) {
+			err(1, "pthread_create");
+		}
+	}
+
+	for (i = 0; i < conns; i++) {
+		(void)pthread_join(t[i], NULL);
+	}
+
+	report();
+	return 0;
+}
+
+/* Read the trace into reqs. */
+static void
+load(const char *path)
+{
+	struct tracerec rec;
+	struct stat st;
+	struct req *r;
+	char *buf, *p, *end;
+	uint64_t first;
+	size_t i, cap;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		err(1, "%s", path);
+	}
+
+	if ((buf = malloc((size_t)st.st_size + 1)) == NULL) {
+		err(1, "malloc");
+	}
+
+	for (p = buf; p < buf + st.st_size; p += n) {
+		if ((n = read(fd, p, (size_t)(buf + st.st_size - p))) <= 0) {
+			err(1, "read %s", path);
+		}
+	}
+
+	(void)close(fd);
+
+	end = buf + st.st_size;
+
+	if (st.st_size < (off_t)sizeof(TRACE_MAGIC) - 1
+		|| memcmp(buf, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) != 0) {
+		errx(1, "%s: not a trace", path);
+	}
+
+	cap = 0;
+
+	for (p = buf + sizeof(TRACE_MAGIC) - 1; p < end;) {
+		if (end - p < (ptrdiff_t)sizeof(rec)) {
+			warnx("%s: truncated", path);
+			break;
+		}
+
+		(void)memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+
+		if (end - p < (ptrdiff_t)rec.pathlen + rec.hostlen) {
+			warnx("%s: truncated", path);
+			break;
+		}
+
+		if (nreqs == cap) {
+			cap = cap != 0 ? 2 * cap : 1024;
+
+			if ((r = reallocarray(reqs, cap, sizeof(*reqs)))
+				== NULL) {
+				err(1, "reallocarray");
+			}
+
+			reqs = r;
+		}
+
+		r = &reqs[nreqs++];
+		(void)memset(r, 0, sizeof(*r));
+		r->at = rec.usec;
+		r->head = rec.head;
+
+		if ((r->path = strndup(p, rec.pathlen)) == NULL
+			|| (rec.hostlen != 0 && (r->host = strndup(p
+			+ rec.pathlen, rec.hostlen)) == NULL)) {
+			err(1, "strndup");
+		}
+
+		p += rec.pathlen + rec.hostlen;
+	}
+
+	free(buf);
+
+	if (nreqs == 0) {
+		errx(1, "%s: no requests", path);
+	}
+
+	/* Workers append as they get to requests, which is close to but not
+	 * quite arrival order. */
+	qsort(reqs, nreqs, sizeof(*reqs), atcmp);
+	first = reqs[0].at;
+
+	for (i = 0; i < nreqs; i++) {
+		r = &reqs[i];
+		r->at = speed == 0 ? 0
+			: (uint64_t)((double)(r->at - first) * 1000 / speed);
+	}
+}
+
+static void *
+player(void *arg)
+{
+	struct timespec ts;
+	struct req *r;
+	uint64_t at;
+
+	(void)arg;
+
+	while (1) {
+		(void)pthread_mutex_lock(&lock);
+		r = next < nreqs ? &reqs[next++] : NULL;
+		(void)pthread_mutex_unlock(&lock);
+
+		if (r == NULL) {
+			return NULL;
+		}
+
+		at = start + r->at;
+		ts.tv_sec = (time_t)(at / 1000000000);
+		ts.tv_nsec = (long)(at % 1000000000);
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+			== EINTR) {
+		}
+
+		/* Every connection was busy when this one was due. */
+		r->late = speed != 0 && nsec() - at > LATE;
+
+		play(r);
+	}
+}
+
+static void
+play(struct req *r)
+{
+	char buf[BUF_LEN];
+	char *hdr;
+	size_t len, body;
+	uint64_t t;
+	ssize_t n;
+	int fd, status;
+
+	t = nsec();
+	r->cls = C_ERROR;
+
+	if ((fd = socket(addr->ai_family, addr->ai_socktype,
+		addr->ai_protocol)) == -1) {
+		warn("socket");
+		return;
+	}
+
+	if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+		goto done;
+	}
+
+	n = snprintf(buf, sizeof(buf), "%s %s HTTP/1.1\r\n%s%s%s"
+		"Connection: close\r\n\r\n", r->head ? "HEAD" : "GET", r->path,
+		r->host != NULL ? "Host: " : "", r->host != NULL ? r->host : "",
+		r->host != NULL ? "\r\n" : "");
+
+	if (n < 0 || (size_t)n >= sizeof(buf)
+		|| write(fd, buf, (size_t)n) != n) {
+		goto done;
+	}
+
+	/* The status line and headers are taken from the first read. */
+	len = 0;
+	body = 0;
+	status = 0;
+
+	while ((n = read(fd, buf, sizeof(buf) - 1)) > 0) {
+		if (len == 0) {
+			buf[n] = '\0';
+			(void)sscanf(buf, "HTTP/%*s %d", &status);
+
+			if ((hdr = strstr(buf, "\r\n\r\n")) != NULL) {
+				body = (size_t)(buf + n - hdr - 4);
+			}
+		} else {
+			body += (size_t)n;
+		}
+
+		len += (size_t)n;
+	}
+
+	if (n == 0 && status != 0) {
+		r->cls = classify(r, status, body);
+	}
+
+done:
+	r->lat = nsec() - t;
+	(void)close(fd);
+}
+
+static int
+classify(const struct req *r, int status, size_t body)
+{
+	const char *q;
+	size_t n;
+
+	switch (status) {
+	case 200:
+		break;
+	case 404:
+		return C_404;
+	case 503:
+		return C_503;
+	default:
+		return C_OTHER;
+	}
+
+	n = (q = strchr(r->path, '?')) != NULL ? (size_t)(q - r->path)
+		: strlen(r->path);
+
+	if (q != NULL && strstr(q, "archive=") != NULL) {
+		return C_TAR;
+	} else if (n > 0 && r->path[n-1] == '/') {
+		return C_DIR;
+	}
+
+	return body < SMALL ? C_SMALL : C_LARGE;
+}
+
+/* Latency percentiles of each class, in ms. */
+static void
+report(void)
+{
+	uint64_t *lat;
+	uint64_t end;
+	size_t i, n, late;
+	int c;
+
+	end = nsec();
+
+	if ((lat = calloc(nreqs, sizeof(*lat))) == NULL) {
+		err(1, "calloc");
+	}
+
+	(void)printf("%-12s %8s %9s %9s %9s %9s\n", "class", "count",
+		"p50 ms", "p90 ms", "p99 ms", "max ms");
+
+	for (c = 0; c < C_MAX; c++) {
+		for (i = 0, n = 0; i < nreqs; i++) {
+			if (reqs[i].cls == c) {
+				lat[n++] = reqs[i].lat;
+			}
+		}
+
+		if (n == 0) {
+			continue;
+		}
+
+		qsort(lat, n, sizeof(*lat), latcmp);
+
+		(void)printf("%-12s %8zu %9.3f %9.3f %9.3f %9.3f\n",
+			classes[c], n, (double)lat[n / 2] / 1e6,
+			(double)lat[n * 9 / 10] / 1e6,
+			(double)lat[n * 99 / 100] / 1e6,
+			(double)lat[n - 1] / 1e6);
+	}
+
+	for (i = 0, late = 0; i < nreqs; i++) {
+		late += (size_t)reqs[i].late;
+	}
+
+	(void)printf("%zu requests in %.3f s, %zu started late\n", nreqs,
+		(double)(end - start) / 1e9, late);
+
+	free(lat);
+}
+
+static int
+atcmp(const void *a, const void *b)
+{
+	const struct req *x, *y;
+
+	x = a;
+	y = b;
+
+	return x->at < y->at ? -1 : x->at > y->at;
+}
+
+static int
+latcmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
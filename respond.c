@@ -2,19 +2,32 @@
 /* need DT_DIR from readdir */
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
+#define _GNU_SOURCE /* SEEK_DATA, SEEK_HOLE */
 #endif
 
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
+#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -22,11 +35,107 @@
 
 #define BUF_LEN		8192
 #define TBUF_LEN	512
+#define QBUF_LEN	512
+#define DIGEST_LEN	256
+#define IFRANGE_LEN	128
+#define SEND_LEN	(1 << 20)
+
+#define COPY_LEN	(128 << 10)
+#define RA_LEN		(2 << 20)
+#define EVICT_LAG	(4 << 20) /* bytes kept cached behind the send position */
+#define HOLE_MIN	(1 << 20) /* smaller bodies aren't checked for holes */
+
+#define MINRATE_GRACE	5000 /* ms before -m is enforced */
+#define FOLLOW_TICK	1000 /* ms between checks on an idle follower */
+
+#ifndef MSG_MORE
+#define MSG_MORE	0
+#endif
+
+/* Request phases, in the order they end. */
+enum {
+	PH_READ,
+	PH_RESOLVE,
+	PH_STAT,
+	PH_TIME,
+	PH_SNIFF,
+	PH_HEADER,
+	PH_BODY,
+	PH_LIST,
+	PH_MAX
+};
+
+/* Phase boundaries. The timestamps feed the -S slow request log; built with
+ * USE_SDT, each boundary is also a static probe named after the phase, with
+ * the socket and resolved path as arguments. */
+#ifdef USE_SDT
+#include <sys/sdt.h>
+#define MARK(C, P, N)	do {						\
+	DTRACE_PROBE2(filesrv, N, (C)->afd, (C)->path);			\
+	mark((C), (P));							\
+} while (0)
+#else
+#define MARK(C, P, N)	mark((C), (P))
+#endif
+
+enum {
+	FADV_SEQUENTIAL,
+	FADV_WILLNEED,
+	FADV_DONTNEED
+};
+
+struct xfer {
+	uint64_t start;
+	off_t	 off;		/* file offset of the first byte */
+	off_t	 len;		/* bytes to send */
+	size_t	 sent;
+	size_t	 minrate;	/* bytes/s, or 0 */
+	size_t	 rate;		/* bytes/s paced in user space, or 0 */
+	int	 evict;		/* drop pages behind the send position */
+	off_t	 dropped;
+	int	 flight;	/* reader id in a shared stream, or -1 */
+};
 
 #if BUF_LEN < PATH_MAX
 #error BUF_LEN too small
 #endif
 
+#define CACHELINE	64
+
+/* Everything a connection needs beyond the stack, so a request never
+ * allocates and its footprint is fixed at sizeof(struct conn). Per-request
+ * fields come first and the buffers start on their own cache line.
+ * Connections are served one at a time, so one conn is enough; bulk children
+ * get their own copy through fork. */
+struct conn {
+	int	 afd;
+	int	 head;
+	int	 http10;	/* HTTP/1.0 or earlier, so no chunked bodies */
+	struct srv *srv;
+	const char *dir;	/* document root of the request's host */
+	size_t	 dirlen;
+	char	*path;		/* resolved path, in rbuf */
+	char	*key;		/* index key of path, or NULL */
+	char	*qend;		/* end of query parameters in qbuf */
+	uint64_t deadline;	/* header deadline, ms, or 0 */
+	uint64_t epoch;		/* from indexneg(), or 0 */
+	uint64_t start;		/* ns, if timing phases */
+	uint64_t t[PH_MAX];	/* end of each phase, ns, or 0 */
+	int	 range;		/* a single byte range was requested */
+	off_t	 rfirst;	/* or -1 for a suffix of rlast bytes */
+	off_t	 rlast;		/* or -1 for the end of the file */
+	struct xfer x;
+
+	_Alignas(CACHELINE)
+	char	 rbuf[BUF_LEN];	/* read buffer, path buffer */
+	char	 wbuf[BUF_LEN];	/* response buffer, path swap buffer */
+	char	 tbuf[TBUF_LEN];	/* time format buffer */
+	char	 qbuf[QBUF_LEN];	/* NUL-separated query parameters */
+	char	 mime[MIME_LEN];	/* MIME type from the index, or empty */
+	char	 ifrange[IFRANGE_LEN];	/* If-Range validator, or empty */
+	char	 cbuf[COPY_LEN];	/* copy buffer */
+};
+
 #define NL	"\r\n"
 #define SP	" \t\v\f"
 
@@ -35,74 +144,273 @@
 #define TIMEOUT(X)	((X) == EAGAIN || (X) == EWOULDBLOCK || (X) == EINPROGRESS)
 #define DOT(X)		(strcmp((X), ".") == 0 || strcmp((X), "..") == 0)
 
-static void	writefile(int, char *, char *, char *, off_t, int);
-static void	writedir(int, char *, char *, char *, int);
-static int	cat(int, int, char *);
-static void	status(int, char *, char *);
+static int	request(struct conn *);
+static int	readable(struct conn *);
+static int	lookup(struct conn *, struct stat *);
+static char *	canonical(struct conn *, int *);
+static void	byterange(struct conn *, const char *);
+static int	writefile(struct conn *, int, const struct stat *);
+static int	writefollow(struct conn *, int, const struct stat *,
+		    const char *);
+static void	follow(struct conn *, int, off_t);
+static int	chunks(struct conn *, int, off_t *, off_t);
+static int	gone(int);
+static void	norange(struct conn *, off_t);
+static int	writeblocks(struct conn *, const struct stat *);
+static int	writepack(struct conn *, const struct packfile *);
+static void	writedir(struct conn *);
+static int	writetar(struct conn *);
+static int	tarwalk(struct conn *, size_t, size_t, off_t *, size_t *, int);
+static int	tarname(struct conn *, size_t *, const char *);
+static int	zeros(struct conn *, size_t *, off_t);
+static char *	param(struct conn *, const char *);
+static int	cat(struct conn *, int);
+static int	copy(struct conn *, int);
+static int	span(struct conn *, int, size_t, off_t);
+#ifdef SEEK_HOLE
+static int	holes(struct conn *, int, off_t, size_t);
+#endif
+static int	progress(int, struct xfer *, size_t);
+static void	pace(struct conn *, int);
+static size_t	chunklen(const struct xfer *);
+static void	hint(int, off_t, off_t, int);
+static size_t	ratelimit(struct conn *);
+static int	kpace(int, size_t);
+static void	throttle(uint64_t, size_t, size_t);
+static uint64_t	msec(void);
+static uint64_t	nsec(void);
+static void	mark(struct conn *, int);
+static void	slowlog(struct conn *);
+static int	append(struct conn *, size_t *, const char *, size_t);
+static int	writeall(int, const char *, size_t);
+static void	status(struct conn *, char *);
 
 #define HTTP_400	"400 Bad Request"
 #define HTTP_403	"403 Forbidden"
 #define HTTP_404	"404 Not Found"
 #define HTTP_405	"405 Method Not Allowed"
 #define HTTP_408	"408 Request Timeout"
+#define HTTP_416	"416 Range Not Satisfiable"
 #define HTTP_500	"500 Internal Server Error"
 
-void
-respond(int afd, char *dir, size_t dirlen)
+#define SHED_RESP	"HTTP/1.1 503 Service Unavailable\r\n" \
+			"Content-Length: 24\r\n" \
+			"Content-Type: text/plain; charset=utf-8\r\n" \
+			"Retry-After: 1\r\n" \
+			"\r\n" \
+			"503 Service Unavailable\n"
+
+/* For paths the index knows not to exist. */
+#define NOENT_RESP	"HTTP/1.1 404 Not Found\r\n" \
+			"Content-Length: 14\r\n" \
+			"Content-Type: text/plain; charset=utf-8\r\n" \
+			"\r\n" \
+			"404 Not Found\n"
+
+int
+respond(int afd, struct srv *srv)
+{
+	static struct conn conn;
+	struct conn *c;
+	int rv;
+
+	c = &conn;
+	c->afd = afd;
+	c->head = 0;
+	c->http10 = 0;
+	c->srv = srv;
+	c->dir = srv->dir;
+	c->dirlen = srv->dirlen;
+	c->path = NULL;
+	c->key = NULL;
+	c->mime[0] = '\0';
+	c->ifrange[0] = '\0';
+	c->range = 0;
+	c->qend = c->qbuf;
+	c->deadline = 0;
+	c->epoch = 0;
+	c->start = srv->slow != 0 ? nsec() : 0;
+	(void)memset(c->t, 0, sizeof(c->t));
+
+	/* Handed off requests are logged by the bulk child. */
+	if ((rv = request(c)) == 0) {
+		slowlog(c);
+	}
+
+	return rv;
+}
+
+static int
+request(struct conn *c)
 {
-	static char rbuf[BUF_LEN]; /* read buffer, path buffer */
-	static char wbuf[BUF_LEN]; /* response buffer, path swap buffer */
-	static char tbuf[TBUF_LEN]; /* time format buffer */
+	struct packfile pf;
+	struct fsop op;
 	struct stat st;
+	struct srv *srv;
 	struct tm *tm;
+	size_t dirlen;
 	size_t len;
 	ssize_t n;
-	int head;
 	char *line, *word, *lline, *lword;
+	char *host, *value;
+	char *rbuf, *wbuf;
+	const char *dir;
 	char *path;
+	int afd;
+	int fd;
+	int rv;
+	int slash;
 
-	head = 0;
+	afd = c->afd;
+	srv = c->srv;
+	rbuf = c->rbuf;
+	wbuf = c->wbuf;
+	len = 0;
 
-	if ((n = read(afd, rbuf, BUF_LEN-1)) == -1) {
-		if (TIMEOUT(errno)) {
-			status(afd, wbuf, HTTP_408);
-		} else {
-			warn("read");
+	/* Read until the end of the headers. The deadline bounds the whole
+	 * header from accept, so a client trickling bytes can't hold the
+	 * server: SO_RCVTIMEO covers the first read, and later ones wait no
+	 * longer than what's left. */
+	if (srv->timeout != 0) {
+		c->deadline = msec() + (uint64_t)srv->timeout * 1000;
+	}
+
+	for (n = 0;;) {
+		/* Past the first read, including after an interrupted one. */
+		if ((len != 0 || n == -1) && c->deadline != 0
+			&& readable(c) == -1) {
+			if (TIMEOUT(errno)) {
+				status(c, HTTP_408);
+			} else {
+				warn("poll");
+			}
+			return 0;
+		}
+
+		if ((n = read(afd, rbuf + len, BUF_LEN-1 - len)) == -1) {
+			/* Sockets with a timeout aren't restarted after a
+			 * profiler tick. */
+			if (errno == EINTR) {
+				continue;
+			} else if (TIMEOUT(errno)) {
+				status(c, HTTP_408);
+			} else {
+				warn("read");
+			}
+			return 0;
+		}
+
+		rbuf[len + (size_t)n] = '\0';
+
+		if (n == 0 || strstr(rbuf + (len > 3 ? len - 3 : 0), NL NL)
+			!= NULL || strstr(rbuf + (len > 1 ? len - 1 : 0), "\n\n")
+			!= NULL) {
+			break;
+		}
+
+		len += (size_t)n;
+
+		if (len == BUF_LEN-1) {
+			break;
 		}
-		return;
 	}
 
-	rbuf[n] = '\0';
+	MARK(c, PH_READ, read);
 
 	if (shutdown(afd, SHUT_RD) == -1) {
 		if (errno != ENOTCONN) {
 			warn("shutdown rd");
 		}
-		return;
+		return 0;
 	}
 
 	if ((line = strtok_r(rbuf, NL, &lline)) == NULL) {
-		status(afd, wbuf, HTTP_400);
-		return;
+		status(c, HTTP_400);
+		return 0;
 	}
 
 	if ((word = strtok_r(line, SP, &lword)) == NULL) {
-		status(afd, wbuf, HTTP_400);
-		return;
+		status(c, HTTP_400);
+		return 0;
 	}
 
 	if (strcmp(word, "HEAD") == 0) {
-		head = 1;
+		c->head = 1;
 	} else if (strcmp(word, "GET") != 0) {
-		status(afd, wbuf, HTTP_405);
-		return;
+		status(c, HTTP_405);
+		return 0;
 	}
 
 	if ((path = strtok_r(NULL, SP NL, &lword)) == NULL) {
-		status(afd, wbuf, HTTP_400);
-		return;
+		status(c, HTTP_400);
+		return 0;
+	}
+
+	/* Without a version, it's HTTP/0.9. */
+	word = strtok_r(NULL, SP NL, &lword);
+	c->http10 = word == NULL || strcmp(word, "HTTP/1.0") == 0
+		|| strcmp(word, "HTTP/0.9") == 0;
+
+	/* The headers that matter; rbuf is reused by realpath(), so the range
+	 * is taken in now. */
+	host = NULL;
+
+	while ((line = strtok_r(NULL, NL, &lline)) != NULL) {
+		if ((value = strchr(line, ':')) == NULL) {
+			continue;
+		}
+
+		value += 1 + strspn(value + 1, SP);
+
+		if (strncasecmp(line, "Host:", 5) == 0) {
+			host = value;
+		} else if (strncasecmp(line, "Range:", 6) == 0) {
+			byterange(c, value);
+		} else if (strncasecmp(line, "If-Range:", 9) == 0
+			&& (len = strlen(value)) < IFRANGE_LEN) {
+			(void)memcpy(c->ifrange, value, len + 1);
+		}
+	}
+
+	if (srv->trace) {
+		trace(c->head, path, host);
+	}
+
+	/* rbuf is reused by realpath(), so the query is kept aside. Overlong
+	 * queries are ignored. */
+	if ((line = strchr(path, '?')) != NULL) {
+		*line++ = '\0';
+
+		if ((len = strlen(line)) < QBUF_LEN) {
+			(void)memcpy(c->qbuf, line, len + 1);
+			c->qend = c->qbuf + len;
+
+			for (line = c->qbuf; (line = strchr(line, '&')) != NULL;) {
+				*line++ = '\0';
+			}
+		}
+	}
+
+	/* Packs are mounted on request paths, for every host, so -l matches on
+	 * the path as it is. */
+	if ((fd = packget(path, &pf)) == 0) {
+		c->path = path;
+		c->dir = "";
+		c->dirlen = 0;
+		MARK(c, PH_RESOLVE, resolve);
+		return writepack(c, &pf);
+	} else if (fd == -2) {
+		(void)writeall(c->afd, NOENT_RESP, sizeof(NOENT_RESP) - 1);
+		return 0;
+	}
+
+	if (srv->vhost) {
+		c->dir = vhost(host, &c->dirlen);
 	}
 
+	dir = c->dir;
+	dirlen = c->dirlen;
+
 	if (dirlen != 0 && dir[dirlen-1] == '/') {
 		path++;
 	}
@@ -110,252 +418,1426 @@ respond(int afd, char *dir, size_t dirlen)
 	len = strlen(path);
 	if (len + dirlen + 1 > BUF_LEN) {
 		/* ENAMETOOLONG */
-		status(afd, wbuf, HTTP_404);
-		return;
+		status(c, HTTP_404);
+		return 0;
 	}
 
 	(void)memcpy(wbuf, dir, dirlen);
 	(void)memcpy(wbuf + dirlen, path, len+1);
 
-	if ((path = realpath(wbuf, rbuf)) == NULL) {
+	if ((fd = lookup(c, &st)) == -2) {
+		(void)writeall(c->afd, NOENT_RESP, sizeof(NOENT_RESP) - 1);
+		return 0;
+	}
+
+	if (fd != -1) {
+		path = c->path;
+		MARK(c, PH_RESOLVE, resolve);
+		MARK(c, PH_STAT, stat);
+		goto found;
+	}
+
+	/* On the pool, the steps up to sniffing a regular file all run before
+	 * any of them is checked. */
+	if ((rv = offload(wbuf, rbuf, &op)) == -1) {
+		shed(afd);
+		return 0;
+	}
+
+	if (rv == 1) {
+		path = realpath(wbuf, rbuf);
+	} else if (op.step == FS_RESOLVE) {
+		errno = op.err;
+		path = NULL;
+	} else {
+		path = rbuf;
+		fd = op.fd;
+	}
+
+	if (path == NULL) {
 		switch (errno) {
 		case EACCES:
-			status(afd, wbuf, HTTP_403);
+			status(c, HTTP_403);
 			break;
 		case ENOENT:
-			status(afd, wbuf, HTTP_404);
+			/* realpath() left rbuf in pieces, and status() is
+			 * about to reuse wbuf. */
+			if (c->epoch != 0 && (word = canonical(c, &slash))
+				!= NULL) {
+				indexnoent(word, c->epoch);
+			}
+
+			status(c, HTTP_404);
 			break;
 		default:
-			status(afd, wbuf, HTTP_400);
+			status(c, HTTP_400);
 		}
-		return;
+		return 0;
 	}
 
-	if (memcmp(dir, path, dirlen) != 0) {
-		/* Path escapes sandbox. */
-		status(afd, wbuf, HTTP_404);
-		return;
+	c->path = path;
+	MARK(c, PH_RESOLVE, resolve);
+
+	if (memcmp(dir, path, dirlen) != 0 || (dir[dirlen-1] != '/'
+		&& path[dirlen] != '/' && path[dirlen] != '\0')) {
+		/* Path escapes sandbox, or the host's root. */
+		if (fd != -1) {
+			(void)close(fd);
+		}
+		status(c, HTTP_404);
+		return 0;
 	}
 
-	if (stat(path, &st) == -1) {
+	if (rv == 0 ? op.step == FS_STAT : stat(path, &st) == -1) {
+		if (rv == 0) {
+			errno = op.err;
+		}
+
 		switch (errno) {
 		case EACCES:
-			status(afd, wbuf, HTTP_403);
+			status(c, HTTP_403);
 			break;
 		case ENOENT:
-			status(afd, wbuf, HTTP_404);
+			status(c, HTTP_404);
 			break;
 		default:
-			status(afd, wbuf, HTTP_400);
+			status(c, HTTP_400);
 		}
-		return;
+		return 0;
 	}
 
-	if ((tm = gmtime(&st.st_mtim.tv_sec)) == NULL) {
-		status(afd, wbuf, HTTP_500);
-		return;
+	if (rv == 0) {
+		st = op.st;
 	}
 
-	if (strftime(tbuf, TBUF_LEN, TIMEFMT, tm) == 0) {
-		status(afd, wbuf, HTTP_500);
-		return;
+	MARK(c, PH_STAT, stat);
+
+	/* Learn paths that resolved to themselves, give or take a trailing
+	 * slash. Keys are relative to the served directory, whichever host's
+	 * root the path is in. */
+	len = strlen(path);
+	dirlen = srv->dirlen;
+	if (strncmp(path, wbuf, len) == 0 && (wbuf[len] == '\0'
+		|| (wbuf[len] == '/' && wbuf[len+1] == '\0'))
+		&& (srv->dir[dirlen-1] == '/' || path[dirlen] == '/'
+		|| path[dirlen] == '\0')) {
+		c->key = path + dirlen + (path[dirlen] == '/');
+
+		if (S_ISDIR(st.st_mode)) {
+			indexput(c->key, &st, NULL);
+		}
+	}
+
+	if (rv == 0 && op.mime != NULL) {
+		(void)strncpy(c->mime, op.mime, MIME_LEN - 1);
+		c->mime[MIME_LEN - 1] = '\0';
+
+		if (c->key != NULL) {
+			indexput(c->key, &st, c->mime);
+		}
+	}
+
+found:
+	if ((tm = gmtime(&st.st_mtim.tv_sec)) == NULL
+		|| strftime(c->tbuf, TBUF_LEN, TIMEFMT, tm) == 0) {
+		status(c, HTTP_500);
+		if (fd != -1) {
+			(void)close(fd);
+		}
+		return 0;
 	}
 
+	MARK(c, PH_TIME, time);
+
 	if (S_ISREG(st.st_mode)) {
-		writefile(afd, wbuf, path, tbuf, st.st_size, head);
-	} else if (S_ISDIR(st.st_mode)) {
-		writedir(afd, wbuf, path, tbuf, head);
+		if ((word = param(c, "manifest")) != NULL
+			&& strcmp(word, "blocks") == 0) {
+			if (fd != -1 && close(fd) == -1) {
+				warn("close");
+			}
+			return writeblocks(c, &st);
+		}
+		return writefile(c, fd, &st);
+	}
+
+	if (fd != -1 && close(fd) == -1) {
+		warn("close");
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if ((word = param(c, "archive")) != NULL
+			&& strcmp(word, "tar") == 0) {
+			return writetar(c);
+		}
+		writedir(c);
 	} else {
-		status(afd, wbuf, HTTP_404);
+		status(c, HTTP_404);
 	}
+
+	return 0;
 }
 
-static void
-writefile(int afd, char *wbuf, char *path, char *time, off_t size, int head)
+/* Wait until more of the request header can be read, failing with EAGAIN
+ * once the deadline passes. */
+static int
+readable(struct conn *c)
 {
-	ssize_t n;
-	int fd;
+	struct pollfd pfd;
+	uint64_t now;
 
-	if ((fd = open(path, O_RDONLY)) == -1) {
-		switch (errno) {
-		case EACCES:
-			status(afd, wbuf, HTTP_403);
+	pfd.fd = c->afd;
+	pfd.events = POLLIN;
+
+	while ((now = msec()) < c->deadline) {
+		switch (poll(&pfd, 1, (int)(c->deadline - now))) {
+		case -1:
+			if (errno != EINTR) {
+				return -1;
+			}
 			break;
-		case ENOENT:
-			status(afd, wbuf, HTTP_404);
+		case 0:
 			break;
 		default:
-			status(afd, wbuf, HTTP_400);
+			return 0;
 		}
-		return;
 	}
 
-	n = snprintf(wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
-		"Content-Length: %zd\r\n"
-		"Content-Type: %s\r\n"
-		"Last-Modified: %s\r\n"
-		"\r\n", (ssize_t)size, sniff(fd, path), time);
+	errno = EAGAIN;
+	return -1;
+}
 
-	if (n < 0) {
-		warnx("snprintf");
-		status(afd, wbuf, HTTP_500);
-		goto done;
+/* Find the request path in wbuf in the index. On a hit, the path is opened
+ * without resolving it and checked against the entry, and the descriptor
+ * returned with st filled in; the path is left in rbuf. Returns -1 if the
+ * path must be resolved the slow way, -2 if it is known not to exist. */
+static int
+lookup(struct conn *c, struct stat *st)
+{
+	struct stat ist;
+	char *key;
+	int slash;
+	int flags;
+	int fd;
+
+	if ((key = canonical(c, &slash)) == NULL) {
+		return -1;
 	}
 
-	if (write(afd, wbuf, (size_t)n) == -1 || head) {
-		goto done;
+	if (indexget(key, &ist, c->mime, MIME_LEN) == -1) {
+		return indexneg(key, &c->epoch) ? -2 : -1;
 	}
 
-	if (cat(fd, afd, wbuf) == -1) {
-		if (!TIMEOUT(errno)) {
-			warn("cat");
+	if (slash && !S_ISDIR(ist.st_mode)) {
+		return -1;
+	}
+
+	/* A link swapped in for the last component fails here; one further up
+	 * leads to a different inode. Opening doesn't wait for a writer if a
+	 * FIFO was swapped in. */
+	if ((fd = open(c->rbuf, O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) == -1) {
+		if (errno == ENOENT) {
+			indexdel(key);
 		}
+		c->mime[0] = '\0';
+		return -1;
 	}
 
-done:
-	if (close(fd) == -1) {
-		warn("close file");
+	if (fstat(fd, st) == -1 || st->st_dev != ist.st_dev
+		|| st->st_ino != ist.st_ino
+		|| !(S_ISREG(st->st_mode) || S_ISDIR(st->st_mode))
+		|| (flags = fcntl(fd, F_GETFL)) == -1
+		|| fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+		(void)close(fd);
+		c->mime[0] = '\0';
+		return -1;
+	}
+
+	if (st->st_size != ist.st_size
+		|| st->st_mtim.tv_sec != ist.st_mtim.tv_sec
+		|| st->st_mtim.tv_nsec != ist.st_mtim.tv_nsec) {
+		c->mime[0] = '\0';
+		indexput(key, st, NULL);
+	}
+
+	c->path = c->rbuf;
+	c->key = key;
+
+	return fd;
+}
+
+/* Copy the request path in wbuf to rbuf without a trailing slash, and
+ * return its index key if it is already in the form realpath() would give:
+ * no empty, "." or ".." components. */
+static char *
+canonical(struct conn *c, int *slash)
+{
+	char *key, *p;
+	size_t dirlen, len, n;
+
+	dirlen = c->dirlen;
+	len = strlen(c->wbuf);
+
+	if ((*slash = len > dirlen && c->wbuf[len-1] == '/')) {
+		len--;
+	}
+
+	(void)memcpy(c->rbuf, c->wbuf, len);
+	c->rbuf[len] = '\0';
+
+	key = c->rbuf + dirlen;
+
+	if (c->dir[dirlen-1] != '/' && *key != '\0' && *key++ != '/') {
+		return NULL;
+	}
+
+	for (p = key; *p != '\0'; p += n + (p[n] == '/')) {
+		n = strcspn(p, "/");
+
+		if (n == 0 || (n == 1 && p[0] == '.')
+			|| (n == 2 && p[0] == '.' && p[1] == '.')
+			|| (p[n] == '/' && p[n+1] == '\0')) {
+			return NULL;
+		}
+	}
+
+	/* The directory itself, without the slash skipped above. */
+	if (*key == '\0' && key != c->rbuf + dirlen
+		&& c->dir[dirlen-1] != '/') {
+		return NULL;
+	}
+
+	/* A host's root is a resolved subdirectory of the served directory,
+	 * which keys are relative to. */
+	if (c->dir != c->srv->dir) {
+		dirlen = c->srv->dirlen;
+		key = c->rbuf + dirlen + (c->srv->dir[dirlen-1] != '/');
 	}
+
+	return key;
 }
 
+/* Take a Range header value if it is a single byte range, "first-last",
+ * "first-" or "-suffix". Anything else, several ranges included, is ignored
+ * and the whole file sent. */
 static void
-writedir(int afd, char *wbuf, char *path, char *time, int head)
+byterange(struct conn *c, const char *s)
 {
-	DIR *dir;
-	struct dirent *d;
-	size_t size;
-	size_t tmp;
+	char *end;
+	long long first, last;
+
+	if (strncasecmp(s, "bytes=", 6) != 0) {
+		return;
+	}
+
+	s += 6;
+	first = -1;
+	last = -1;
+	errno = 0;
+
+	if (isdigit((unsigned char)*s)) {
+		first = strtoll(s, &end, 10);
+		s = end;
+	}
+
+	if (*s++ != '-') {
+		return;
+	}
+
+	if (isdigit((unsigned char)*s)) {
+		last = strtoll(s, &end, 10);
+		s = end;
+	} else if (first == -1) {
+		return;
+	}
+
+	if (errno != 0 || s[strspn(s, SP)] != '\0'
+		|| (first != -1 && last != -1 && last < first)) {
+		return;
+	}
+
+	c->range = 1;
+	c->rfirst = (off_t)first;
+	c->rlast = (off_t)last;
+}
+
+/* Returns 1 if the connection was handed to a bulk child. fd is the open
+ * file, or -1. */
+static int
+writefile(struct conn *c, int fd, const struct stat *st)
+{
+	char digest[DIGEST_LEN];
+	struct srv *srv;
+	char *mime, *p;
+	off_t size, off, len;
 	ssize_t n;
+	pid_t pid;
+	int partial;
+	int follow;
+
+	srv = c->srv;
+	size = st->st_size;
+	off = 0;
+	len = size;
+	partial = 0;
 
-	if ((dir = opendir(path)) == NULL) {
+	if (fd == -1 && (fd = open(c->path, O_RDONLY)) == -1) {
 		switch (errno) {
 		case EACCES:
-			status(afd, wbuf, HTTP_403);
+			status(c, HTTP_403);
 			break;
 		case ENOENT:
-			status(afd, wbuf, HTTP_404);
+			status(c, HTTP_404);
 			break;
 		default:
-			status(afd, wbuf, HTTP_400);
+			status(c, HTTP_400);
 		}
-		return;
+		return 0;
 	}
 
-#define PRE_1	"<pre>\n"
-#define PRE_2	"</pre>\n"
-#define LINK_1	"<a href=\"./"
-#define LINK_2	"\">"
-#define LINK_3	"</a>\n"
+	follow = srv->maxfollow != 0 && (p = param(c, "follow")) != NULL
+		&& strcmp(p, "1") == 0;
 
-	size = sizeof(PRE_1) + sizeof(PRE_2) - 2;
+	/* Looked up before forking so a miss is queued in this process. A
+	 * growing file isn't worth hashing. */
+	digest[follow ? 0 : digesthdr(st, c->path, digest, DIGEST_LEN)] = '\0';
 
-	/* Calculate Content-Length. */
-	errno = 0;
-	while ((d = readdir(dir)) != NULL) {
-		if (DOT(d->d_name)) {
-			continue;
+	if (c->mime[0] != '\0') {
+		mime = c->mime;
+	} else {
+		mime = sniff(fd, c->path);
+
+		if (c->key != NULL) {
+			indexput(c->key, st, mime);
 		}
+	}
 
-		tmp = 2 * strlen(d->d_name)
-			+ sizeof(LINK_1) - 1
-			+ sizeof(LINK_2) - 1
-			+ sizeof(LINK_3) - 1;
+	MARK(c, PH_SNIFF, sniff);
 
-		if (d->d_type == DT_DIR) {
-			tmp += 2;
+	if (follow) {
+		return writefollow(c, fd, st, mime);
+	}
+
+	pid = -1;
+
+	/* A range only applies to the version of the file If-Range names: its
+	 * ETag, once the digest is known, or its exact Last-Modified date. */
+	if (c->range && (c->ifrange[0] == '\0'
+		|| strcmp(c->ifrange, c->tbuf) == 0
+		|| (strncmp(digest, "ETag: ", 6) == 0
+		&& strncmp(digest + 6, c->ifrange, strlen(c->ifrange)) == 0
+		&& digest[6 + strlen(c->ifrange)] == '\r'))) {
+		if (c->rfirst == -1) {
+			len = c->rlast < size ? c->rlast : size;
+			off = size - len;
+		} else if (c->rfirst < size) {
+			off = c->rfirst;
+			len = (c->rlast == -1 || c->rlast >= size ? size
+				: c->rlast + 1) - off;
+		} else {
+			len = 0;
 		}
 
-		if (size + tmp < size) {
-			warnx("writedir size overflow");
+		if (len == 0) {
+			norange(c, size);
 			goto done;
 		}
 
-		size += tmp;
+		if (off != 0 && lseek(fd, off, SEEK_SET) == -1) {
+			warn("lseek");
+			status(c, HTTP_500);
+			goto done;
+		}
+
+		partial = 1;
 	}
 
-	if (errno != 0) {
-		if (errno == ENOENT) {
-			status(afd, wbuf, HTTP_404);
-		} else {
-			warn("readddir first");
-			status(afd, wbuf, HTTP_500);
+	/* Large bodies go to a child so small requests aren't queued behind
+	 * them. Past the child limit they are served inline as before. */
+	if (!c->head && srv->maxbulk != 0 && len >= srv->bulksize
+		&& (pid = bulk(srv)) > 0) {
+		if (close(fd) == -1) {
+			warn("close file");
 		}
-		goto done;
+		return 1;
 	}
 
-	rewinddir(dir);
-
-	n = snprintf(wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
-		"Content-Length: %zu\r\n"
-		"Content-Type: text/html; charset=utf-8\r\n"
-		"Last-Modified: %s\r\n"
-		"\r\n", size, time);
+	if (partial) {
+		n = snprintf(c->wbuf, BUF_LEN,
+			"HTTP/1.1 206 Partial Content\r\n"
+			"Content-Length: %jd\r\n"
+			"Content-Range: bytes %jd-%jd/%jd\r\n"
+			"Content-Type: %s\r\n"
+			"Last-Modified: %s\r\n"
+			"%s"
+			"\r\n", (intmax_t)len, (intmax_t)off,
+			(intmax_t)(off + len - 1), (intmax_t)size, mime,
+			c->tbuf, digest);
+	} else {
+		n = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"Content-Length: %zd\r\n"
+			"Content-Type: %s\r\n"
+			"Last-Modified: %s\r\n"
+			"%s"
+			"\r\n", (ssize_t)size, mime, c->tbuf, digest);
+	}
 
 	if (n < 0) {
 		warnx("snprintf");
-		status(afd, wbuf, HTTP_500);
-		goto done;
-	}
-
-	if (write(afd, wbuf, (size_t)n) == -1 || head) {
+		status(c, HTTP_500);
 		goto done;
 	}
 
-	if (write(afd, PRE_1, sizeof(PRE_1) - 1) == -1) {
+	if (write(c->afd, c->wbuf, (size_t)n) == -1 || c->head) {
 		goto done;
 	}
 
-	errno = 0;
-	while ((d = readdir(dir)) != NULL) {
-		if (DOT(d->d_name)) {
-			continue;
-		}
+	MARK(c, PH_HEADER, header);
 
-		tmp = strlen(d->d_name);
+	(void)memset(&c->x, 0, sizeof(c->x));
+	c->x.off = off;
+	c->x.len = len;
+	c->x.minrate = srv->minrate;
+	c->x.evict = srv->evictsize != 0 && size >= srv->evictsize;
+	pace(c, 1);
 
-		/* Write link to file or directory. */
-		if (write(afd, LINK_1, sizeof(LINK_1) - 1) == -1
-			|| write(afd, d->d_name, tmp) == -1
-			|| (d->d_type == DT_DIR && write(afd, "/", 1) == -1)
-			|| write(afd, LINK_2, sizeof(LINK_2) - 1) == -1
-			|| write(afd, d->d_name, tmp) == -1
-			|| (d->d_type == DT_DIR && write(afd, "/", 1) == -1)
-			|| write(afd, LINK_3, sizeof(LINK_3) - 1) == -1) {
-			goto done;
+	if (cat(c, fd) == -1) {
+		if (errno != 0 && !TIMEOUT(errno)) {
+			warn("cat");
 		}
 	}
 
-	if (errno != 0) {
-		if (errno != ENOENT) {
-			warn("readdir second");
-		}
-		goto done;
-	}
+	MARK(c, PH_BODY, body);
 
-	if (write(afd, PRE_2, sizeof(PRE_2) - 1) == -1) {
-		goto done;
+done:
+	if (close(fd) == -1) {
+		warn("close file");
+	}
+
+	if (pid == 0) {
+		(void)shutdown(c->afd, SHUT_RDWR);
+		slowlog(c);
+		_exit(0);
+	}
+
+	return 0;
+}
+
+/* Hand the connection to a follower child, which sends the file from the
+ * offset= parameter on and then what is appended to it, as chunks. Returns 1
+ * if the connection was handed to the child; fd is closed either way. */
+static int
+writefollow(struct conn *c, int fd, const struct stat *st, const char *mime)
+{
+	char *p, *end;
+	off_t off;
+	ssize_t n;
+	pid_t pid;
+
+	off = 0;
+
+	if ((p = param(c, "offset")) != NULL) {
+		errno = 0;
+		off = (off_t)strtoll(p, &end, 10);
+
+		if (!isdigit((unsigned char)*p) || *end != '\0' || errno != 0) {
+			status(c, HTTP_400);
+			goto done;
+		}
+	}
+
+	/* Past the end, the file was most likely truncated or replaced. */
+	if (off > st->st_size) {
+		norange(c, st->st_size);
+		goto done;
+	}
+
+	pid = -1;
+
+	if (!c->head && (pid = follower(c->srv)) == -1) {
+		(void)writeall(c->afd, SHED_RESP, sizeof(SHED_RESP) - 1);
+		goto done;
+	} else if (pid > 0) {
+		if (close(fd) == -1) {
+			warn("close file");
+		}
+		return 1;
+	}
+
+	/* HTTP/1.0 clients can't take chunks, so the body just ends when the
+	 * connection does. */
+	n = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
+		"Cache-Control: no-store\r\n"
+		"Content-Type: %s\r\n"
+		"%s"
+		"\r\n", mime, c->http10 ? "Connection: close\r\n"
+		: "Transfer-Encoding: chunked\r\n");
+
+	if (n < 0) {
+		warnx("snprintf");
+		status(c, HTTP_500);
+	} else if (writeall(c->afd, c->wbuf, (size_t)n) == 0 && !c->head) {
+		MARK(c, PH_HEADER, header);
+		follow(c, fd, off);
+	}
+
+	/* Streams are expected to be long, so they aren't slow logged. */
+	if (pid == 0) {
+		(void)shutdown(c->afd, SHUT_RDWR);
+		_exit(0);
+	}
+
+done:
+	if (close(fd) == -1) {
+		warn("close file");
+	}
+
+	return 0;
+}
+
+/* Send fd from pos, then whatever is appended to it, until the file is
+ * deleted, renamed or truncated, filesrv exits, or the client goes away.
+ * inotify wakes the follower as the file changes on Linux; elsewhere, or
+ * without an inotify instance to spare, it looks every FOLLOW_TICK ms. */
+static void
+follow(struct conn *c, int fd, off_t pos)
+{
+	struct pollfd pfd;
+	struct stat st, cur;
+	pid_t parent;
+	int last;
+#ifdef __linux__
+	char ev[sizeof(struct inotify_event) + NAME_MAX + 1];
+#endif
+
+	parent = getppid();
+	pfd.fd = -1;
+	pfd.events = POLLIN;
+	last = 0;
+
+#ifdef __linux__
+	if ((pfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1
+		&& inotify_add_watch(pfd.fd, c->path, IN_MODIFY | IN_ATTRIB
+		| IN_MOVE_SELF) == -1) {
+		(void)close(pfd.fd);
+		pfd.fd = -1;
+	}
+#endif
+
+	while (1) {
+		if (fstat(fd, &st) == -1 || st.st_size < pos) {
+			break;
+		}
+
+		/* Once the path names another file or none, as after log
+		 * rotation, send what is left and stop. */
+		if (stat(c->path, &cur) == -1 || cur.st_dev != st.st_dev
+			|| cur.st_ino != st.st_ino) {
+			last = 1;
+		}
+
+		if (st.st_size > pos && chunks(c, fd, &pos, st.st_size) == -1) {
+			goto done;
+		}
+
+		if (last || getppid() != parent || gone(c->afd)) {
+			break;
+		}
+
+		if (poll(&pfd, 1, FOLLOW_TICK) <= 0) {
+			continue;
+		}
+
+#ifdef __linux__
+		/* Appends come in floods of events; one look at the file
+		 * covers them all. */
+		while (read(pfd.fd, ev, sizeof(ev)) > 0) {
+		}
+#endif
+	}
+
+	/* The last chunk, ending the body. */
+	if (!c->http10) {
+		(void)writeall(c->afd, "0\r\n\r\n", 5);
+	}
+
+done:
+	if (pfd.fd != -1) {
+		(void)close(pfd.fd);
+	}
+}
+
+/* Send fd from *pos up to end as chunks, or as is to HTTP/1.0 clients,
+ * straight from the page cache where sendfile(2) allows. */
+static int
+chunks(struct conn *c, int fd, off_t *pos, off_t end)
+{
+	char hdr[32];
+	size_t len, left;
+	ssize_t r;
+	char *p;
+	int n;
+
+	while (*pos < end) {
+		len = end - *pos < SEND_LEN ? (size_t)(end - *pos) : SEND_LEN;
+
+		n = c->http10 ? 0 : snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+		if (n < 0) {
+			return -1;
+		}
+
+		/* Like writeall(), but held back to go out with the data. */
+		for (p = hdr; n > 0; n -= (int)r, p += r) {
+			if ((r = send(c->afd, p, (size_t)n, MSG_MORE)) <= 0) {
+				if (r == -1 && errno == EINTR) {
+					r = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+
+		for (left = len; left > 0; left -= (size_t)r) {
+#ifdef __linux__
+			r = sendfile(c->afd, fd, pos, left);
+#else
+			if ((r = pread(fd, c->cbuf, left < COPY_LEN ? left
+				: COPY_LEN, *pos)) > 0) {
+				if (writeall(c->afd, c->cbuf, (size_t)r) == -1) {
+					return -1;
+				}
+				*pos += r;
+			}
+#endif
+			if (r <= 0) {
+				if (r == -1 && errno == EINTR) {
+					r = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+
+		if (!c->http10 && writeall(c->afd, "\r\n", 2) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Whether the client closed the connection, which a follower with nothing to
+ * send can't see otherwise: it already shut down its reading side. */
+static int
+gone(int afd)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	return getsockopt(afd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0
+		&& ti.tcpi_state != TCP_ESTABLISHED;
+#else
+	(void)afd;
+	return 0;
+#endif
+}
+
+static void
+norange(struct conn *c, off_t size)
+{
+	int n = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 " HTTP_416 "\r\n"
+		"Content-Length: %zu\r\n"
+		"Content-Range: bytes */%jd\r\n"
+		"Content-Type: text/plain; charset=utf-8\r\n"
+		"\r\n"
+		HTTP_416 "\n", sizeof(HTTP_416), (intmax_t)size);
+
+	if (n < 0) {
+		warnx("snprintf");
+		return;
+	}
+
+	(void)writeall(c->afd, c->wbuf, (size_t)n);
+}
+
+/* Send the block manifest of the file from the digest threads, or a 503 with
+ * Retry-After while they compute it. Large manifests go to bulk children like
+ * files. Returns 1 if the connection was handed to one. */
+static int
+writeblocks(struct conn *c, const struct stat *st)
+{
+	struct manifest *m;
+	struct srv *srv;
+	ssize_t n;
+	pid_t pid;
+	int rv;
+
+	srv = c->srv;
+
+	if ((rv = digestblocks(st, c->path, &m)) == -1) {
+		status(c, HTTP_404);
+		return 0;
+	} else if (rv == 1) {
+		/* Allow about a second per 256 MiB of file. */
+		n = snprintf(c->wbuf, BUF_LEN,
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Content-Length: 24\r\n"
+			"Content-Type: text/plain; charset=utf-8\r\n"
+			"Retry-After: %jd\r\n"
+			"\r\n"
+			"503 Service Unavailable\n",
+			(intmax_t)(1 + (st->st_size >> 28)));
+
+		if (n > 0) {
+			(void)writeall(c->afd, c->wbuf, (size_t)n);
+		}
+		return 0;
+	}
+
+	MARK(c, PH_SNIFF, sniff);
+
+	pid = -1;
+
+	if (!c->head && srv->maxbulk != 0 && (off_t)m->len >= srv->bulksize
+		&& (pid = bulk(srv)) > 0) {
+		digestrelease(m);
+		return 1;
+	}
+
+	n = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
+		"Content-Length: %zu\r\n"
+		"Content-Type: text/plain; charset=utf-8\r\n"
+		"Last-Modified: %s\r\n"
+		"\r\n", m->len, c->tbuf);
+
+	if (n < 0) {
+		warnx("snprintf");
+		status(c, HTTP_500);
+	} else if (writeall(c->afd, c->wbuf, (size_t)n) == 0 && !c->head) {
+		MARK(c, PH_HEADER, header);
+		(void)writeall(c->afd, m->text, m->len);
+		MARK(c, PH_BODY, body);
+	}
+
+	/* A child leaves m alone: a digest thread may have held the lock at the
+	 * fork. */
+	if (pid == 0) {
+		(void)shutdown(c->afd, SHUT_RDWR);
+		slowlog(c);
+		_exit(0);
+	}
+
+	digestrelease(m);
+	return 0;
+}
+
+/* Send a pack entry, the header and the body straight from the mapping, in
+ * one write where the socket takes it and no limit applies. Large entries go
+ * to bulk children like files. Returns 1 if the connection was handed to
+ * one. */
+static int
+writepack(struct conn *c, const struct packfile *f)
+{
+	char digest[DIGEST_LEN];
+	const struct packent *e;
+	struct iovec iov[2], v[2];
+	struct xfer *x;
+	struct srv *srv;
+	struct tm *tm;
+	time_t sec;
+	size_t n, chunk;
+	ssize_t w;
+	pid_t pid;
+	int i, len;
+
+	e = f->ent;
+	srv = c->srv;
+	sec = (time_t)e->sec;
+
+	if ((tm = gmtime(&sec)) == NULL
+		|| strftime(c->tbuf, TBUF_LEN, TIMEFMT, tm) == 0) {
+		status(c, HTTP_500);
+		return 0;
+	}
+
+	MARK(c, PH_TIME, time);
+
+	digest[digestfmt(e->md, digest, DIGEST_LEN)] = '\0';
+
+	len = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
+		"Content-Length: %ju\r\n"
+		"Content-Type: %s\r\n"
+		"Last-Modified: %s\r\n"
+		"%s"
+		"\r\n", (uintmax_t)e->size, e->mime, c->tbuf, digest);
+
+	if (len < 0) {
+		warnx("snprintf");
+		status(c, HTTP_500);
+		return 0;
+	}
+
+	pid = -1;
+
+	if (!c->head && srv->maxbulk != 0 && (off_t)e->size >= srv->bulksize
+		&& (pid = bulk(srv)) > 0) {
+		return 1;
+	}
+
+	x = &c->x;
+	(void)memset(x, 0, sizeof(*x));
+	x->len = (off_t)e->size;
+	x->minrate = srv->minrate;
+	x->flight = -1;
+	pace(c, 1);
+	x->start = x->minrate != 0 || x->rate != 0 ? msec() : 0;
+	chunk = chunklen(x);
+
+	iov[0].iov_base = c->wbuf;
+	iov[0].iov_len = (size_t)len;
+	iov[1].iov_base = (void *)(uintptr_t)f->body;
+	iov[1].iov_len = c->head ? 0 : (size_t)e->size;
+
+	while (iov[0].iov_len + iov[1].iov_len > 0) {
+		v[0] = iov[0];
+		v[1] = iov[1];
+		if (v[1].iov_len > chunk) {
+			v[1].iov_len = chunk;
+		}
+
+		if ((w = writev(c->afd, v, 2)) <= 0) {
+			if (w == -1 && errno == EINTR) {
+				continue;
+			} else if (w == -1 && !TIMEOUT(errno)) {
+				warn("writev");
+			}
+			goto done;
+		}
+
+		for (i = 0; i < 2; i++) {
+			n = (size_t)w < iov[i].iov_len ? (size_t)w
+				: iov[i].iov_len;
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+			w -= (ssize_t)n;
+
+			if (i == 1 && n > 0 && progress(-1, x, n) == -1) {
+				goto done;
+			}
+		}
+	}
+
+	MARK(c, PH_BODY, body);
+
+done:
+	if (pid == 0) {
+		(void)shutdown(c->afd, SHUT_RDWR);
+		slowlog(c);
+		_exit(0);
+	}
+
+	return 0;
+}
+
+static void
+writedir(struct conn *c)
+{
+	DIR *dir;
+	struct dirent *d;
+	size_t len;
+	size_t size;
+	size_t tmp;
+	ssize_t n;
+
+	if ((dir = opendir(c->path)) == NULL) {
+		switch (errno) {
+		case EACCES:
+			status(c, HTTP_403);
+			break;
+		case ENOENT:
+			status(c, HTTP_404);
+			break;
+		default:
+			status(c, HTTP_400);
+		}
+		return;
+	}
+
+#define PRE_1	"<pre>\n"
+#define PRE_2	"</pre>\n"
+#define LINK_1	"<a href=\"./"
+#define LINK_2	"\">"
+#define LINK_3	"</a>\n"
+
+	size = sizeof(PRE_1) + sizeof(PRE_2) - 2;
+
+	/* Calculate Content-Length. */
+	errno = 0;
+	while ((d = readdir(dir)) != NULL) {
+		if (DOT(d->d_name)) {
+			continue;
+		}
+
+		tmp = 2 * strlen(d->d_name)
+			+ sizeof(LINK_1) - 1
+			+ sizeof(LINK_2) - 1
+			+ sizeof(LINK_3) - 1;
+
+		if (d->d_type == DT_DIR) {
+			tmp += 2;
+		}
+
+		if (size + tmp < size) {
+			warnx("writedir size overflow");
+			goto done;
+		}
+
+		size += tmp;
+	}
+
+	if (errno != 0) {
+		if (errno == ENOENT) {
+			status(c, HTTP_404);
+		} else {
+			warn("readddir first");
+			status(c, HTTP_500);
+		}
+		goto done;
+	}
+
+	rewinddir(dir);
+
+	n = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
+		"Content-Length: %zu\r\n"
+		"Content-Type: text/html; charset=utf-8\r\n"
+		"Last-Modified: %s\r\n"
+		"\r\n", size, c->tbuf);
+
+	if (n < 0) {
+		warnx("snprintf");
+		status(c, HTTP_500);
+		goto done;
+	}
+
+	len = (size_t)n;
+
+	if (c->head) {
+		(void)writeall(c->afd, c->wbuf, len);
+		goto done;
+	}
+
+	if (append(c, &len, PRE_1, sizeof(PRE_1) - 1) == -1) {
+		goto done;
+	}
+
+	/* Listing is coalesced in wbuf rather than written per entry. */
+	errno = 0;
+	while ((d = readdir(dir)) != NULL) {
+		if (DOT(d->d_name)) {
+			continue;
+		}
+
+		tmp = strlen(d->d_name);
+
+		/* Write link to file or directory. */
+		if (append(c, &len, LINK_1, sizeof(LINK_1) - 1) == -1
+			|| append(c, &len, d->d_name, tmp) == -1
+			|| (d->d_type == DT_DIR && append(c, &len, "/", 1) == -1)
+			|| append(c, &len, LINK_2, sizeof(LINK_2) - 1) == -1
+			|| append(c, &len, d->d_name, tmp) == -1
+			|| (d->d_type == DT_DIR && append(c, &len, "/", 1) == -1)
+			|| append(c, &len, LINK_3, sizeof(LINK_3) - 1) == -1) {
+			goto done;
+		}
+	}
+
+	if (errno != 0) {
+		if (errno != ENOENT) {
+			warn("readdir second");
+		}
+		goto done;
+	}
+
+	if (append(c, &len, PRE_2, sizeof(PRE_2) - 1) == -1) {
+		goto done;
+	}
+
+	(void)writeall(c->afd, c->wbuf, len);
+	MARK(c, PH_LIST, list);
+
+done:
+	if (closedir(dir) == -1) {
+		warn("close dir");
+	}
+}
+
+/* Stream the tree under c->path as a tar archive. Only regular files and
+ * directories are included, found without following symlinks, so nothing
+ * outside the directory respond() resolved is reachable. The tree is walked
+ * twice, once for Content-Length and once to send it; entries that appear in
+ * between are skipped and vanished or shrunken ones are padded, so the
+ * length always holds. Returns 1 if a bulk child took the connection. */
+static int
+writetar(struct conn *c)
+{
+	char name[NAME_MAX + 1];
+	struct srv *srv;
+	off_t total, left;
+	size_t len, plen, i;
+	ssize_t n;
+	pid_t pid;
+	char *base;
+
+	srv = c->srv;
+	plen = strlen(c->path);
+	total = 2 * TAR_BLOCK;
+
+	if (tarwalk(c, plen, plen + 1, &total, NULL, 0) == -1) {
+		status(c, HTTP_500);
+		return 0;
+	}
+
+	pid = -1;
+
+	if (!c->head && srv->maxbulk != 0 && total >= srv->bulksize
+		&& (pid = bulk(srv)) > 0) {
+		return 1;
+	}
+
+	if ((base = strrchr(c->path, '/')) == NULL || *++base == '\0') {
+		base = "root";
+	}
+
+	/* The name goes in a quoted header parameter, so anything that could
+	 * end the string or the header line is replaced. */
+	for (i = 0; i < NAME_MAX && base[i] != '\0'; i++) {
+		name[i] = isalnum((unsigned char)base[i]) || base[i] == '.'
+			|| base[i] == '_' || base[i] == '-' ? base[i] : '_';
+	}
+	name[i] = '\0';
+
+	n = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 200 OK\r\n"
+		"Content-Length: %jd\r\n"
+		"Content-Type: application/x-tar\r\n"
+		"Content-Disposition: attachment; filename=\"%s.tar\"\r\n"
+		"Last-Modified: %s\r\n"
+		"\r\n", (intmax_t)total, name, c->tbuf);
+
+	if (n < 0 || n >= BUF_LEN) {
+		warnx("snprintf");
+		status(c, HTTP_500);
+		goto done;
+	}
+
+	len = (size_t)n;
+
+	if (c->head) {
+		(void)writeall(c->afd, c->wbuf, len);
+		goto done;
+	}
+
+	left = total - 2 * TAR_BLOCK;
+
+	if (tarwalk(c, plen, plen + 1, &left, &len, 1) == -1) {
+		goto done;
+	}
+
+	/* The end-of-archive blocks also make up for anything that vanished. */
+	if (zeros(c, &len, left + 2 * TAR_BLOCK) == 0) {
+		(void)writeall(c->afd, c->wbuf, len);
+	}
+
+	MARK(c, PH_BODY, body);
+
+done:
+	if (pid == 0) {
+		(void)shutdown(c->afd, SHUT_RDWR);
+		slowlog(c);
+		_exit(0);
+	}
+
+	return 0;
+}
+
+/* Walk the directory in c->rbuf[0, plen), whose archive names start at
+ * c->rbuf + rel. Without send, add each member's size to *size; with it,
+ * send the members that still fit in *size bytes and deduct them, with
+ * *len bytes of wbuf pending. */
+static int
+tarwalk(struct conn *c, size_t plen, size_t rel, off_t *size, size_t *len,
+	int send)
+{
+	static char hdr[TAR_BLOCK];
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+	off_t msize;
+	size_t n;
+	char *p;
+	int fd;
+	int lname;
+	int rv;
+
+	p = c->rbuf;
+	rv = 0;
+
+	if ((dir = opendir(p)) == NULL) {
+		/* Unreadable subdirectories are left out. */
+		return 0;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		if (DOT(d->d_name)) {
+			continue;
+		}
+
+		n = strlen(d->d_name);
+
+		if (plen + n + 3 > BUF_LEN) {
+			continue;
+		}
+
+		p[plen] = '/';
+		(void)memcpy(p + plen + 1, d->d_name, n + 1);
+
+		if (lstat(p, &st) == -1
+			|| !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+			goto next;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			(void)memcpy(p + plen + 1 + n, "/", 2);
+		}
+
+		lname = tarhdr(hdr, p + rel, &st);
+		msize = tarsize(p + rel, &st);
+
+		if (!send) {
+			*size += msize;
+		} else if (msize > *size) {
+			/* New since the first walk, or grown: left out, with
+			 * anything below it. */
+			goto next;
+		} else {
+			*size -= msize;
+
+			if (lname && tarname(c, len, p + rel) == -1) {
+				rv = -1;
+				break;
+			}
+
+			if (append(c, len, hdr, TAR_BLOCK) == -1) {
+				rv = -1;
+				break;
+			}
+
+			if (S_ISREG(st.st_mode) && st.st_size != 0) {
+				if (writeall(c->afd, c->wbuf, *len) == -1) {
+					rv = -1;
+					break;
+				}
+
+				*len = 0;
+
+				(void)memset(&c->x, 0, sizeof(c->x));
+				c->x.len = st.st_size;
+				c->x.minrate = c->srv->minrate;
+				c->x.evict = c->srv->evictsize != 0
+					&& st.st_size >= c->srv->evictsize;
+				pace(c, 0);
+
+				if ((fd = open(p, O_RDONLY | O_NOFOLLOW)) != -1) {
+					rv = cat(c, fd);
+					(void)close(fd);
+				}
+
+				/* Pad the block, and anything that went
+				 * missing since the stat. */
+				if (rv == -1 || zeros(c, len, (st.st_size
+					+ TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK
+					- (off_t)c->x.sent) == -1) {
+					rv = -1;
+					break;
+				}
+			}
+		}
+
+		p[plen + 1 + n] = '\0';
+
+		if (S_ISDIR(st.st_mode)
+			&& tarwalk(c, plen + 1 + n, rel, size, len, send) == -1) {
+			rv = -1;
+			break;
+		}
+
+next:
+		p[plen] = '\0';
 	}
 
-done:
+	p[plen] = '\0';
+
 	if (closedir(dir) == -1) {
 		warn("close dir");
 	}
+
+	return rv;
+}
+
+/* Send a GNU long name member for name. */
+static int
+tarname(struct conn *c, size_t *len, const char *name)
+{
+	static char hdr[TAR_BLOCK];
+	size_t n;
+
+	n = strlen(name) + 1;
+	tarlong(hdr, n - 1);
+
+	if (append(c, len, hdr, TAR_BLOCK) == -1
+		|| append(c, len, name, n) == -1
+		|| zeros(c, len, (off_t)((TAR_BLOCK - n % TAR_BLOCK) % TAR_BLOCK))
+		== -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+zeros(struct conn *c, size_t *len, off_t n)
+{
+	static const char zero[TAR_BLOCK];
+	size_t k;
+
+	for (; n > 0; n -= (off_t)k) {
+		k = n < TAR_BLOCK ? (size_t)n : TAR_BLOCK;
+
+		if (append(c, len, zero, k) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Copy up to c->x.len bytes of in to the connection, as described by c->x.
+ * Stops early without error at end of file. Files too big for one readahead
+ * share their reads with concurrent transfers of the same file. */
+static int
+cat(struct conn *c, int in)
+{
+	int rv, saved;
+
+	c->x.flight = c->x.len > RA_LEN && c->x.off == 0 ? flightjoin(in,
+		RA_LEN, c->x.evict ? EVICT_LAG : 0) : -1;
+
+	rv = copy(c, in);
+
+	if (c->x.flight != -1) {
+		saved = errno;
+		flightleave(c->x.flight);
+		errno = saved;
+	}
+
+	return rv;
+}
+
+/* Copy from the current position of in. Large files with holes in the range
+ * are sent an extent at a time. */
+static int
+copy(struct conn *c, int in)
+{
+	struct xfer *x;
+	size_t chunk;
+#ifdef SEEK_HOLE
+	off_t pos, hole;
+#endif
+
+	x = &c->x;
+	x->sent = 0;
+	x->dropped = x->off;
+	x->start = x->minrate != 0 || x->rate != 0 ? msec() : 0;
+	chunk = chunklen(x);
+
+	hint(in, 0, 0, FADV_SEQUENTIAL);
+
+#ifdef SEEK_HOLE
+	/* A file without holes has only the one at its end. */
+	if (x->len >= HOLE_MIN && (pos = lseek(in, 0, SEEK_CUR)) != -1
+		&& (hole = lseek(in, pos, SEEK_HOLE)) != -1) {
+		if (lseek(in, pos, SEEK_SET) == -1) {
+			return -1;
+		}
+
+		if (hole < pos + x->len) {
+			return holes(c, in, pos, chunk);
+		}
+	}
+#endif
+
+	return span(c, in, chunk, x->len);
 }
 
+/* Send from the current position of in until lim bytes of the transfer are
+ * sent, in pieces of chunk bytes. Stops early without error at end of file. */
 static int
-cat(int in, int out, char *wbuf)
+span(struct conn *c, int in, size_t chunk, off_t lim)
 {
+	struct xfer *x;
+	size_t want;
 	ssize_t r, off, w;
+	r = 0;
 	w = 0;
+	x = &c->x;
+
+#define LEFT(X, N)	((off_t)(X)->sent + (off_t)(N) <= lim ? (N) \
+			: (size_t)(lim - (off_t)(X)->sent))
+
+#ifdef __linux__
+	/* Send straight from the page cache when the file supports it. */
+	while ((want = LEFT(x, chunk)) > 0
+		&& ((r = sendfile(c->afd, in, NULL, want)) > 0
+		|| (r == -1 && errno == EINTR))) {
+		if (r > 0 && progress(in, x, (size_t)r) == -1) {
+			return -1;
+		}
+	}
+
+	if (want == 0) {
+		return 0;
+	}
+
+	if (r == 0) {
+		return 0;
+	} else if (errno != EINVAL && errno != ENOSYS) {
+		return -1;
+	}
+#endif
+
+	if (chunk > COPY_LEN) {
+		chunk = COPY_LEN;
+	}
 
-	while ((r = read(in, wbuf, BUF_LEN)) > 0) {
+	while ((want = LEFT(x, chunk)) > 0
+		&& (r = read(in, c->cbuf, want)) > 0) {
 		for (off = 0; r > 0; r -= w, off += w) {
-			if ((w = write(out, wbuf + off, (size_t)r)) <= 0) {
+			if ((w = write(c->afd, c->cbuf + off, (size_t)r)) <= 0) {
+				if (w == -1 && errno == EINTR) {
+					w = 0;
+					continue;
+				}
 				return -1;
 			}
 		}
+
+		if (progress(in, x, (size_t)off) == -1) {
+			return -1;
+		}
 	}
 
+#undef LEFT
+
 	if (r == -1) {
 		return -1;
 	}
@@ -363,10 +1845,386 @@ cat(int in, int out, char *wbuf)
 	return 0;
 }
 
+#ifdef SEEK_HOLE
+/* Send a file with holes from pos: data extents as usual, and holes from
+ * memory, so they cost no reads at all. */
+static int
+holes(struct conn *c, int in, off_t pos, size_t chunk)
+{
+	/* Never written, so every page of it is the shared zero page. */
+	static char zero[COPY_LEN];
+	struct xfer *x;
+	off_t cur, data, next, end;
+	size_t want;
+	ssize_t w;
+
+	x = &c->x;
+	end = pos + x->len;
+
+	while ((cur = pos + (off_t)x->sent) < end) {
+		if ((data = lseek(in, cur, SEEK_DATA)) == -1) {
+			if (errno != ENXIO) {
+				return -1;
+			}
+
+			/* Nothing but hole up to the end of the file. */
+			if ((data = lseek(in, 0, SEEK_END)) == -1) {
+				return -1;
+			} else if (data <= cur) {
+				return 0;
+			}
+		}
+
+		next = data < end ? data : end;
+
+		if (data > cur) {
+			for (; cur < next; cur += w) {
+				want = chunk < sizeof(zero) ? chunk
+					: sizeof(zero);
+				if (next - cur < (off_t)want) {
+					want = (size_t)(next - cur);
+				}
+
+				if ((w = write(c->afd, zero, want)) <= 0) {
+					if (w == -1 && errno == EINTR) {
+						w = 0;
+						continue;
+					}
+					return -1;
+				}
+
+				if (progress(in, x, (size_t)w) == -1) {
+					return -1;
+				}
+			}
+
+			continue;
+		}
+
+		if ((data = lseek(in, cur, SEEK_HOLE)) == -1
+			|| lseek(in, cur, SEEK_SET) == -1) {
+			return -1;
+		}
+
+		next = data < end ? data : end;
+
+		if (span(c, in, chunk, next - pos) == -1) {
+			return -1;
+		}
+
+		if (pos + (off_t)x->sent < next) {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* Account for n more bytes sent: keep readahead going, drop pages behind the
+ * send position, and enforce the transfer rates. With minrate set, give up
+ * once the transfer has averaged fewer than minrate bytes/s over at least
+ * MINRATE_GRACE ms, leaving errno 0. in is -1 for bodies in memory. */
+static int
+progress(int in, struct xfer *x, size_t n)
+{
+	uint64_t t;
+	off_t pos;
+
+	x->sent += n;
+	pos = x->off + (off_t)x->sent;
+
+	if (x->flight != -1 && flightstep(x->flight, in, pos) == -1) {
+		/* Fell behind the others; what it passed is theirs to drop. */
+		x->flight = -1;
+		x->dropped = pos;
+	}
+
+	if (x->flight == -1 && in != -1) {
+		hint(in, pos, RA_LEN, FADV_WILLNEED);
+
+		if (x->evict && pos - x->dropped >= 2 * EVICT_LAG) {
+			hint(in, x->dropped, pos - EVICT_LAG - x->dropped,
+				FADV_DONTNEED);
+			x->dropped = pos - EVICT_LAG;
+		}
+	}
+
+	if (x->minrate != 0 && (t = msec() - x->start) > MINRATE_GRACE
+		&& x->sent < x->minrate * t / 1000) {
+		errno = 0;
+		return -1;
+	}
+
+	if (x->rate != 0) {
+		throttle(x->start, x->sent, x->rate);
+	}
+
+	return 0;
+}
+
+/* Apply the -l limit of the request path to the transfer in c->x, with
+ * kernel pacing if asked for and supported. Tar members are paced in user
+ * space: the kernel would also slow what earlier members left queued. */
+static void
+pace(struct conn *c, int kernel)
+{
+	size_t rate;
+
+	if ((rate = ratelimit(c)) == 0) {
+		return;
+	}
+
+	/* Don't abort transfers for being as slow as we made them. */
+	if (c->x.minrate > rate / 2) {
+		c->x.minrate = rate / 2;
+	}
+
+	if (!kernel || kpace(c->afd, rate) == -1) {
+		c->x.rate = rate;
+	}
+}
+
+/* Bytes to send between checks: about a second's worth when a minimum rate
+ * is set, and a tenth of a second's when pacing. */
+static size_t
+chunklen(const struct xfer *x)
+{
+	size_t chunk;
+
+	chunk = SEND_LEN;
+	if (x->minrate != 0 && x->minrate < chunk) {
+		chunk = x->minrate < BUF_LEN ? BUF_LEN : x->minrate;
+	}
+	if (x->rate != 0 && x->rate / 10 < chunk) {
+		chunk = x->rate / 10 < BUF_LEN ? BUF_LEN : x->rate / 10;
+	}
+
+	return chunk;
+}
+
+/* posix_fadvise(2) where available; the advice is only ever a hint. */
+static void
+hint(int fd, off_t off, off_t len, int advice)
+{
+#ifdef POSIX_FADV_SEQUENTIAL
+	switch (advice) {
+	case FADV_SEQUENTIAL:
+		advice = POSIX_FADV_SEQUENTIAL;
+		break;
+	case FADV_WILLNEED:
+		advice = POSIX_FADV_WILLNEED;
+		break;
+	case FADV_DONTNEED:
+		advice = POSIX_FADV_DONTNEED;
+		break;
+	}
+
+	(void)posix_fadvise(fd, off, len, advice);
+#else
+	(void)fd;
+	(void)off;
+	(void)len;
+	(void)advice;
+#endif
+}
+
+/* Rate limit for the longest matching -l prefix, or 0 for none. */
+static size_t
+ratelimit(struct conn *c)
+{
+	struct limit *l, *best;
+	struct srv *srv;
+	char *path;
+	size_t i;
+
+	srv = c->srv;
+
+	/* Match on the path as requested, relative to the host's root. */
+	path = c->path + c->dirlen;
+	if (c->dirlen != 0 && c->dir[c->dirlen-1] == '/') {
+		path--;
+	}
+
+	best = NULL;
+
+	for (i = 0; i < srv->nlimits; i++) {
+		l = &srv->limits[i];
+
+		if (strncmp(path, l->prefix, l->len) == 0
+			&& (best == NULL || l->len > best->len)) {
+			best = l;
+		}
+	}
+
+	return best == NULL ? 0 : best->rate;
+}
+
+/* Have the kernel pace the connection, returning -1 if it can't. */
+static int
+kpace(int afd, size_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+	unsigned int r;
+
+	r = rate > UINT_MAX ? UINT_MAX : (unsigned int)rate;
+
+	return setsockopt(afd, SOL_SOCKET, SO_MAX_PACING_RATE, &r, sizeof(r));
+#else
+	(void)afd;
+	(void)rate;
+	return -1;
+#endif
+}
+
+/* Sleep until sent bytes since start are within rate bytes/s. */
+static void
+throttle(uint64_t start, size_t sent, size_t rate)
+{
+	struct timespec ts;
+	uint64_t due, now;
+
+	due = start + (uint64_t)(sent / rate) * 1000
+		+ (uint64_t)(sent % rate) * 1000 / rate;
+
+	if ((now = msec()) >= due) {
+		return;
+	}
+
+	ts.tv_sec = (time_t)((due - now) / 1000);
+	ts.tv_nsec = (long)((due - now) % 1000) * 1000000;
+
+	(void)nanosleep(&ts, NULL);
+}
+
+static uint64_t
+msec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* The monotonic clock is read through the vDSO on Linux, so a phase costs
+ * tens of nanoseconds, and nothing unless -S is set. */
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+mark(struct conn *c, int phase)
+{
+	if (c->start != 0) {
+		c->t[phase] = nsec();
+	}
+}
+
+/* Log the time spent in each phase of a request that took at least the -S
+ * threshold. Phases a request didn't reach are left out. */
+static void
+slowlog(struct conn *c)
+{
+	static const char *names[PH_MAX] = {
+		"read", "resolve", "stat", "time", "sniff", "header", "body",
+		"list"
+	};
+	char buf[256];
+	uint64_t end, last;
+	size_t len;
+	int i, n;
+
+	if (c->start == 0 || (end = nsec()) - c->start
+		< c->srv->slow * 1000000) {
+		return;
+	}
+
+	buf[0] = '\0';
+	last = c->start;
+
+	for (i = 0, len = 0; i < PH_MAX; i++) {
+		if (c->t[i] == 0) {
+			continue;
+		}
+
+		n = snprintf(buf + len, sizeof(buf) - len, " %s %.3f",
+			names[i], (double)(c->t[i] - last) / 1e6);
+
+		if (n < 0 || (size_t)n >= sizeof(buf) - len) {
+			break;
+		}
+
+		len += (size_t)n;
+		last = c->t[i];
+	}
+
+	warnx("slow request %s: %.3f ms:%s, rest %.3f",
+		c->path != NULL ? c->path : "-",
+		(double)(end - c->start) / 1e6, buf, (double)(end - last) / 1e6);
+}
+
+/* Append to the response buffer, flushing it when full. */
+static int
+append(struct conn *c, size_t *len, const char *s, size_t n)
+{
+	if (*len + n > BUF_LEN) {
+		if (writeall(c->afd, c->wbuf, *len) == -1) {
+			return -1;
+		}
+
+		*len = 0;
+	}
+
+	(void)memcpy(c->wbuf + *len, s, n);
+	*len += n;
+	return 0;
+}
+
+static int
+writeall(int out, const char *buf, size_t len)
+{
+	ssize_t w;
+
+	for (; len > 0; len -= (size_t)w, buf += w) {
+		if ((w = write(out, buf, len)) <= 0) {
+			if (w == -1 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Value of query parameter name, or NULL. */
+static char *
+param(struct conn *c, const char *name)
+{
+	size_t n;
+	char *p;
+
+	n = strlen(name);
+
+	for (p = c->qbuf; p < c->qend; p += strlen(p) + 1) {
+		if (strncmp(p, name, n) == 0 && p[n] == '=') {
+			return p + n + 1;
+		}
+	}
+
+	return NULL;
+}
+
 static void
-status(int fd, char *wbuf, char *code)
+status(struct conn *c, char *code)
 {
-	int n = snprintf(wbuf, BUF_LEN, "HTTP/1.1 %s\r\n"
+	int n = snprintf(c->wbuf, BUF_LEN, "HTTP/1.1 %s\r\n"
 		"Content-Length: %zu\r\n"
 		"Content-Type: text/plain; charset=utf-8\r\n"
 		"\r\n"
@@ -378,5 +2236,22 @@ status(int fd, char *wbuf, char *code)
 	}
 
 	/* Don't care if it fails. */
-	(void)write(fd, wbuf, (size_t)n);
+	(void)write(c->afd, c->wbuf, (size_t)n);
+}
+
+/* Turn a connection away without reading the request or formatting. */
+void
+shed(int afd)
+{
+	static char drain[BUF_LEN];
+
+	/* Take whatever already arrived so close() doesn't reset the
+	 * connection before the client sees the response. */
+	(void)recv(afd, drain, BUF_LEN, MSG_DONTWAIT);
+
+	if (write(afd, SHED_RESP, sizeof(SHED_RESP) - 1) == -1) {
+		return;
+	}
+
+	(void)shutdown(afd, SHUT_RDWR);
 }
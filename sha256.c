@@ -0,0 +1,254 @@
+/* SHA-256 as specified in FIPS 180-4. x86 processors with the SHA
+ * extensions compress blocks with them instead. */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHANI
+#endif
+
+#ifdef SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "filesrv.h"
+
+#define ROR(X, N)	(((X) >> (N)) | ((X) << (32 - (N))))
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void	pick(void);
+static void	blocks(uint32_t *, const uint8_t *, size_t);
+static void	block(uint32_t *, const uint8_t *);
+#ifdef SHANI
+static void	shani(uint32_t *, const uint8_t *, size_t);
+#endif
+
+static pthread_once_t	once = PTHREAD_ONCE_INIT;
+static void		(*compress)(uint32_t *, const uint8_t *, size_t);
+
+void
+sha256_init(struct sha256 *s)
+{
+	(void)pthread_once(&once, pick);
+
+	s->h[0] = 0x6a09e667;
+	s->h[1] = 0xbb67ae85;
+	s->h[2] = 0x3c6ef372;
+	s->h[3] = 0xa54ff53a;
+	s->h[4] = 0x510e527f;
+	s->h[5] = 0x9b05688c;
+	s->h[6] = 0x1f83d9ab;
+	s->h[7] = 0x5be0cd19;
+	s->len = 0;
+}
+
+void
+sha256_update(struct sha256 *s, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t fill, n;
+
+	fill = (size_t)(s->len % 64);
+	s->len += len;
+
+	if (fill != 0) {
+		n = 64 - fill < len ? 64 - fill : len;
+		(void)memcpy(s->buf + fill, p, n);
+		p += n;
+		len -= n;
+
+		if (fill + n < 64) {
+			return;
+		}
+
+		compress(s->h, s->buf, 1);
+	}
+
+	compress(s->h, p, len / 64);
+	p += len - len % 64;
+
+	(void)memcpy(s->buf, p, len % 64);
+}
+
+void
+sha256_final(struct sha256 *s, uint8_t *md)
+{
+	uint64_t bits;
+	size_t fill;
+	int i;
+
+	bits = s->len * 8;
+	fill = (size_t)(s->len % 64);
+
+	s->buf[fill++] = 0x80;
+
+	if (fill > 56) {
+		(void)memset(s->buf + fill, 0, 64 - fill);
+		compress(s->h, s->buf, 1);
+		fill = 0;
+	}
+
+	(void)memset(s->buf + fill, 0, 56 - fill);
+
+	for (i = 0; i < 8; i++) {
+		s->buf[63 - i] = (uint8_t)(bits >> (8 * i));
+	}
+
+	compress(s->h, s->buf, 1);
+
+	for (i = 0; i < 8; i++) {
+		md[4*i] = (uint8_t)(s->h[i] >> 24);
+		md[4*i + 1] = (uint8_t)(s->h[i] >> 16);
+		md[4*i + 2] = (uint8_t)(s->h[i] >> 8);
+		md[4*i + 3] = (uint8_t)s->h[i];
+	}
+}
+
+static void
+pick(void)
+{
+#ifdef SHANI
+	unsigned int a, b, c, d;
+
+	/* SHA in leaf 7, and SSSE3 and SSE4.1 for the shuffles. */
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && b & bit_SHA
+		&& __get_cpuid(1, &a, &b, &c, &d) && c & bit_SSSE3
+		&& c & bit_SSE4_1) {
+		compress = shani;
+		return;
+	}
+#endif
+
+	compress = blocks;
+}
+
+/* Compress n blocks at p into the state h. */
+static void
+blocks(uint32_t *h, const uint8_t *p, size_t n)
+{
+	for (; n > 0; n--, p += 64) {
+		block(h, p);
+	}
+}
+
+static void
+block(uint32_t *s, const uint8_t *p)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i + 1] << 16
+			| (uint32_t)p[4*i + 2] << 8 | (uint32_t)p[4*i + 3];
+	}
+
+	for (; i < 64; i++) {
+		w[i] = (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10))
+			+ w[i-7]
+			+ (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3))
+			+ w[i-16];
+	}
+
+	a = s[0];
+	b = s[1];
+	c = s[2];
+	d = s[3];
+	e = s[4];
+	f = s[5];
+	g = s[6];
+	h = s[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25))
+			+ ((e & f) ^ (~e & g)) + k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	s[0] += a;
+	s[1] += b;
+	s[2] += c;
+	s[3] += d;
+	s[4] += e;
+	s[5] += f;
+	s[6] += g;
+	s[7] += h;
+}
+
+#ifdef SHANI
+/* Four rounds at a time on the state as ABEF and CDGH, with the message
+ * schedule in four registers of four words each. */
+__attribute__((target("sha,ssse3,sse4.1")))
+static void
+shani(uint32_t *h, const uint8_t *p, size_t n)
+{
+	const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL,
+		0x0405060700010203LL);
+	__m128i abef, cdgh, sabef, scdgh, t, msg;
+	__m128i m[4];
+	int i;
+
+	t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+	abef = _mm_alignr_epi8(t, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+	for (; n > 0; n--, p += 64) {
+		sabef = abef;
+		scdgh = cdgh;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(p + 16 * i)), swap);
+			} else {
+				m[i % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(
+					_mm_sha256msg1_epu32(m[i % 4],
+					m[(i + 1) % 4]), _mm_alignr_epi8(
+					m[(i + 3) % 4], m[(i + 2) % 4], 4)),
+					m[(i + 3) % 4]);
+			}
+
+			msg = _mm_add_epi32(m[i % 4],
+				_mm_loadu_si128((const __m128i *)&k[4 * i]));
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+			abef = _mm_sha256rnds2_epu32(abef, cdgh,
+				_mm_shuffle_epi32(msg, 0x0e));
+		}
+
+		abef = _mm_add_epi32(abef, sabef);
+		cdgh = _mm_add_epi32(cdgh, scdgh);
+	}
+
+	t = _mm_shuffle_epi32(abef, 0x1b);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+	_mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(t, cdgh, 0xf0));
+	_mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(cdgh, t, 8));
+}
+#endif
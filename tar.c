@@ -0,0 +1,159 @@
+/* ustar archive headers, with GNU extensions for long names and for members
+ * of 8 GiB and more. */
+
+#include <sys/stat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "filesrv.h"
+
+#define NAME_LEN	100
+#define PREFIX_LEN	155
+
+struct ustar {
+	char name[NAME_LEN];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[PREFIX_LEN];
+	char pad[12];
+};
+
+#define ROUND(X)	(((X) + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK)
+
+static void	fill(struct ustar *, mode_t, uintmax_t, time_t, char);
+static void	octal(char *, size_t, uintmax_t);
+static int	splitname(struct ustar *, const char *);
+
+/* Size of a member in the archive, headers included. */
+off_t
+tarsize(const char *name, const struct stat *st)
+{
+	struct ustar h;
+	off_t size = TAR_BLOCK;
+
+	if (S_ISREG(st->st_mode)) {
+		size += ROUND(st->st_size);
+	}
+
+	if (splitname(&h, name) == -1) {
+		size += TAR_BLOCK + (off_t)ROUND(strlen(name) + 1);
+	}
+
+	return size;
+}
+
+/* Fill in the header for a regular file or directory. Directory names end in
+ * a slash. Returns 1 if the name is too long for ustar, in which case the
+ * member must be preceded by tarlong() and the name itself. */
+int
+tarhdr(char *hdr, const char *name, const struct stat *st)
+{
+	struct ustar *h = (struct ustar *)hdr;
+	int rv;
+
+	(void)memset(hdr, 0, TAR_BLOCK);
+
+	if ((rv = splitname(h, name)) == -1) {
+		(void)memcpy(h->name, name, NAME_LEN);
+		rv = 1;
+	}
+
+	fill(h, st->st_mode & 0777,
+		S_ISREG(st->st_mode) ? (uintmax_t)st->st_size : 0,
+		st->st_mtim.tv_sec, S_ISDIR(st->st_mode) ? '5' : '0');
+
+	return rv;
+}
+
+/* GNU long name header for a name of len bytes, which follows it in the
+ * archive NUL-terminated and padded to a block. */
+void
+tarlong(char *hdr, size_t len)
+{
+	struct ustar *h = (struct ustar *)hdr;
+
+	(void)memset(hdr, 0, TAR_BLOCK);
+	(void)memcpy(h->name, "././@LongLink", 14);
+	fill(h, 0644, len + 1, 0, 'L');
+}
+
+static void
+fill(struct ustar *h, mode_t mode, uintmax_t size, time_t mtime, char type)
+{
+	unsigned char *p;
+	unsigned int sum;
+	size_t i;
+
+	octal(h->mode, sizeof(h->mode), mode);
+	octal(h->uid, sizeof(h->uid), 0);
+	octal(h->gid, sizeof(h->gid), 0);
+	octal(h->mtime, sizeof(h->mtime), (uintmax_t)mtime);
+
+	if (size <= 077777777777) {
+		octal(h->size, sizeof(h->size), size);
+	} else {
+		h->size[0] = (char)0x80;
+		for (i = sizeof(h->size) - 1; i > 0; i--, size >>= 8) {
+			h->size[i] = (char)(size & 0xff);
+		}
+	}
+
+	h->typeflag = type;
+	(void)memcpy(h->magic, "ustar", 6);
+	(void)memcpy(h->version, "00", 2);
+
+	(void)memset(h->chksum, ' ', sizeof(h->chksum));
+	for (p = (unsigned char *)h, sum = 0, i = 0; i < TAR_BLOCK; i++) {
+		sum += p[i];
+	}
+	(void)snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+	h->chksum[7] = ' ';
+}
+
+static void
+octal(char *field, size_t len, uintmax_t n)
+{
+	/* Zero-padded and NUL-terminated, as GNU tar writes them. */
+	(void)snprintf(field, len, "%0*jo", (int)len - 1, n);
+}
+
+/* Names over 100 bytes are split at a slash into prefix and name. */
+static int
+splitname(struct ustar *h, const char *name)
+{
+	size_t len, i;
+
+	if ((len = strlen(name)) <= NAME_LEN) {
+		(void)memcpy(h->name, name, len);
+		return 0;
+	}
+
+	/* Don't split on a directory's trailing slash. */
+	for (i = len - 1; i > 0; i--) {
+		if (name[i - 1] != '/') {
+			continue;
+		}
+
+		if (i - 1 <= PREFIX_LEN && len - i <= NAME_LEN) {
+			(void)memcpy(h->prefix, name, i - 1);
+			(void)memcpy(h->name, name + i, len - i);
+			return 0;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,86 @@
+/* Request traces for replay. Each request is appended with a single write,
+ * so bulk children and workers can share the file without interleaving
+ * records. */
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+static int	fd = -1;
+
+/* Open or create the trace at path, before chroot. Returns the descriptor
+ * to keep when daemonizing. */
+int
+traceopen(const char *path)
+{
+	struct stat st;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644))
+		== -1) {
+		err(1, "trace: open %s", path);
+	}
+
+	if (fstat(fd, &st) == -1) {
+		err(1, "trace: fstat %s", path);
+	}
+
+	/* Appending to an existing trace keeps its magic. */
+	if (st.st_size == 0 && write(fd, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1)
+		!= sizeof(TRACE_MAGIC) - 1) {
+		err(1, "trace: write %s", path);
+	}
+
+	return fd;
+}
+
+/* Record a GET, or a HEAD if head is set, of path with the Host header host,
+ * which may be NULL. */
+void
+trace(int head, const char *path, const char *host)
+{
+	struct tracerec rec;
+	struct timespec ts;
+	struct iovec iov[3];
+	size_t pathlen, hostlen;
+
+	if (fd == -1) {
+		return;
+	}
+
+	pathlen = strlen(path);
+	hostlen = host != NULL ? strcspn(host, " \t") : 0;
+
+	if (pathlen > UINT16_MAX || hostlen > UINT16_MAX) {
+		return;
+	}
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+
+	(void)memset(&rec, 0, sizeof(rec));
+	rec.usec = (uint64_t)ts.tv_sec * 1000000
+		+ (uint64_t)ts.tv_nsec / 1000;
+	rec.pathlen = (uint16_t)pathlen;
+	rec.hostlen = (uint16_t)hostlen;
+	rec.head = (uint8_t)head;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)(uintptr_t)path;
+	iov[1].iov_len = pathlen;
+	iov[2].iov_base = (void *)(uintptr_t)host;
+	iov[2].iov_len = hostlen;
+
+	/* A lost record only thins the trace. */
+	if (writev(fd, iov, 3) == -1 && errno != EINTR) {
+		warn("trace: writev");
+	}
+}
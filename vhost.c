@@ -0,0 +1,166 @@
+/* Name-based virtual hosts. Each subdirectory of the served directory is the
+ * document root of the site it is named after, so one process, its workers,
+ * the index and the caches serve every site; paths stay relative to the
+ * served directory throughout. Links in the served directory make aliases,
+ * as long as they resolve to a subdirectory of it. The table is read once at
+ * startup. */
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "filesrv.h"
+
+struct vhost {
+	char	*name;
+	char	*root;		/* resolved */
+	size_t	 len;
+};
+
+static struct vhost *	hosts;
+static size_t		nhosts;
+static struct vhost *	fallback;
+
+static struct vhost *	find(const char *, size_t);
+static int	hostcmp(const void *, const void *);
+
+/* Read the sites in dir, the current directory. Requests for hosts without
+ * one go to def. */
+void
+vhostinit(const char *dir, const char *def)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	struct vhost *p;
+	size_t cap, dirlen;
+	DIR *d;
+
+	if ((d = opendir(".")) == NULL) {
+		err(1, "vhost: opendir %s", dir);
+	}
+
+	dirlen = strlen(dir);
+	cap = 0;
+
+	while ((ent = readdir(d)) != NULL) {
+		/* Host names never start with a dot. */
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+
+		if (realpath(ent->d_name, path) == NULL
+			|| stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+			continue;
+		}
+
+		if (strncmp(path, dir, dirlen) != 0 || path[dirlen] == '\0'
+			|| (dir[dirlen-1] != '/' && path[dirlen] != '/')) {
+			warnx("vhost %s: outside %s", ent->d_name, dir);
+			continue;
+		}
+
+		if (nhosts == cap) {
+			cap = cap != 0 ? 2 * cap : 16;
+
+			if ((p = reallocarray(hosts, cap, sizeof(*hosts)))
+				== NULL) {
+				err(1, "vhost: reallocarray");
+			}
+
+			hosts = p;
+		}
+
+		p = &hosts[nhosts++];
+
+		if ((p->name = strdup(ent->d_name)) == NULL
+			|| (p->root = strdup(path)) == NULL) {
+			err(1, "vhost: strdup");
+		}
+
+		p->len = strlen(path);
+	}
+
+	(void)closedir(d);
+
+	qsort(hosts, nhosts, sizeof(*hosts), hostcmp);
+
+	if ((fallback = find(def, strlen(def))) == NULL) {
+		errx(1, "vhost %s not found in %s", def, dir);
+	}
+}
+
+/* Return the document root for the Host header value host, NULL if there
+ * was none, and set *len to its length. */
+const char *
+vhost(const char *host, size_t *len)
+{
+	struct vhost *h;
+	size_t n;
+
+	h = NULL;
+
+	if (host != NULL) {
+		/* Drop the port, and the dot of a fully qualified name. */
+		if (host[0] == '[') {
+			n = strcspn(host, "]");
+			n += host[n] == ']';
+		} else {
+			n = strcspn(host, ": \t");
+		}
+
+		if (n > 1 && host[n-1] == '.') {
+			n--;
+		}
+
+		h = find(host, n);
+	}
+
+	if (h == NULL) {
+		h = fallback;
+	}
+
+	*len = h->len;
+	return h->root;
+}
+
+static struct vhost *
+find(const char *name, size_t len)
+{
+	size_t lo, hi, mid;
+	int cmp;
+
+	lo = 0;
+	hi = nhosts;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if ((cmp = strncasecmp(name, hosts[mid].name, len)) == 0) {
+			cmp = hosts[mid].name[len] == '\0' ? 0 : -1;
+		}
+
+		if (cmp == 0) {
+			return &hosts[mid];
+		} else if (cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+hostcmp(const void *a, const void *b)
+{
+	return strcasecmp(((const struct vhost *)a)->name,
+		((const struct vhost *)b)->name);
+}
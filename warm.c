@@ -0,0 +1,556 @@
+/* Prewarming of a hot set of files, so the first requests after a reboot or
+ * deploy don't all wait on the disk. The set is a list of paths and glob
+ * patterns, or the most requested paths of a trace from -R. A few threads
+ * read it into the page cache while requests are served, and lock up to a
+ * budget of it in memory for as long as filesrv runs. */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define NTHREADS	8
+#define STEPS		10	/* progress reports */
+#define QUIET		1000	/* ms between them, at least */
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE	0
+#endif
+
+struct cand {
+	char	*path;
+	const char *root;	/* the path must stay under */
+	size_t	 rootlen;
+	size_t	 order;		/* first place in the list or trace */
+	size_t	 count;		/* requests in the trace */
+};
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static char *		list;	/* read before chroot */
+static size_t		listlen;
+static size_t		top;	/* paths to take, 0 for all */
+static size_t		budget;	/* bytes left to lock */
+static struct cand *	cands;
+static size_t		ncands, capcands, next, ndone;
+static size_t		nfiles, nmissing, nlocked;
+static uint64_t		nbytes, nlockbytes;
+static uint64_t		start, last;
+
+static void	fromlist(const char *, size_t);
+static void	fromtrace(const char *, size_t, int);
+static void	add(const char *, size_t, const char *, size_t,
+	const char *, size_t);
+static void	rank(void);
+static void *	warmer(void *);
+static void	warm(const struct cand *);
+static int	pathcmp(const void *, const void *);
+static int	hotcmp(const void *, const void *);
+static uint64_t	msec(void);
+
+/* Read the hot set from [n:]file, before chroot, and allow lockbudget bytes
+ * of it to be locked. */
+void
+warminit(char *arg, size_t lockbudget)
+{
+	struct rlimit rl;
+	struct stat st;
+	char *file, *end;
+	ssize_t n;
+	int fd;
+
+	file = arg;
+
+	if ((end = strchr(arg, ':')) != NULL) {
+		*end = '\0';
+		top = strtoul(arg, &file, 10);
+
+		if (file == arg || *file != '\0' || top == 0) {
+			errx(1, "invalid warm count '%s'", arg);
+		}
+
+		file = end + 1;
+	}
+
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1) {
+		err(1, "warm: open %s", file);
+	}
+
+	if (fstat(fd, &st) == -1) {
+		err(1, "warm: fstat %s", file);
+	}
+
+	listlen = (size_t)st.st_size;
+
+	if ((list = malloc(listlen + 1)) == NULL) {
+		err(1, "warm: malloc");
+	}
+
+	for (end = list; end < list + listlen; end += n) {
+		if ((n = read(fd, end, (size_t)(list + listlen - end))) <= 0) {
+			err(1, "warm: read %s", file);
+		}
+	}
+
+	list[listlen] = '\0';
+	(void)close(fd);
+
+	budget = lockbudget;
+
+	if (budget == 0) {
+		return;
+	}
+
+	/* Raised while still privileged, since locking happens after
+	 * dropping privileges. */
+	if (getrlimit(RLIMIT_MEMLOCK, &rl) == -1) {
+		err(1, "getrlimit RLIMIT_MEMLOCK");
+	}
+
+	if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < budget) {
+		rl.rlim_cur = budget;
+
+		if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < budget) {
+			rl.rlim_max = budget;
+		}
+
+		if (setrlimit(RLIMIT_MEMLOCK, &rl) == -1) {
+			err(1, "setrlimit RLIMIT_MEMLOCK %zu", budget);
+		}
+	}
+}
+
+/* Start warming the hot set under root, or the hosts' roots with vhosts. Call
+ * in the process that runs longest, so locked files stay locked; the threads
+ * block every signal, so forking afterwards is fine. */
+void
+warmstart(const char *root, int vhosts)
+{
+	sigset_t set, omask;
+	pthread_t t;
+	size_t rootlen;
+	int i;
+
+	if (list == NULL) {
+		return;
+	}
+
+	rootlen = strlen(root);
+
+	if (listlen >= sizeof(TRACE_MAGIC) - 1 && memcmp(list, TRACE_MAGIC,
+		sizeof(TRACE_MAGIC) - 1) == 0) {
+		fromtrace(root, rootlen, vhosts);
+	} else {
+		fromlist(root, rootlen);
+	}
+
+	free(list);
+	list = NULL;
+
+	rank();
+
+	while (top != 0 && ncands > top) {
+		free(cands[--ncands].path);
+	}
+
+	warnx("warm: %zu files", ncands);
+
+	if (ncands == 0) {
+		return;
+	}
+
+	start = msec();
+	last = start;
+
+	(void)sigfillset(&set);
+
+	if ((errno = pthread_sigmask(SIG_BLOCK, &set, &omask)) != 0) {
+		err(1, "pthread_sigmask");
+	}
+
+	for (i = 0; i < NTHREADS && (size_t)i < ncands; i++) {
+		if ((errno = pthread_create(&t, NULL, warmer, NULL)) != 0) {
+			err(1, "pthread_create");
+		}
+
+		(void)pthread_detach(t);
+	}
+
+	if ((errno = pthread_sigmask(SIG_SETMASK, &omask, NULL)) != 0) {
+		err(1, "pthread_sigmask");
+	}
+}
+
+/* One path or glob pattern per line, relative to root. Blank lines and lines
+ * starting with # are skipped. */
+static void
+fromlist(const char *root, size_t rootlen)
+{
+	char *line, *last, *pat;
+	glob_t g;
+	size_t i, n, len;
+
+	for (line = strtok_r(list, "\r\n", &last); line != NULL;
+		line = strtok_r(NULL, "\r\n", &last)) {
+		if (*line == '#') {
+			continue;
+		}
+
+		while (*line == '/') {
+			line++;
+		}
+
+		len = strlen(line);
+
+		if (len == 0 || rootlen + len + 2 > PATH_MAX) {
+			continue;
+		}
+
+		if ((pat = malloc(rootlen + len + 2)) == NULL) {
+			err(1, "warm: malloc");
+		}
+
+		(void)memcpy(pat, root, rootlen);
+		n = rootlen;
+		if (n == 0 || pat[n-1] != '/') {
+			pat[n++] = '/';
+		}
+		(void)memcpy(pat + n, line, len + 1);
+
+		/* A path matching nothing is kept, to be counted missing. */
+		if (glob(pat, GLOB_NOCHECK, NULL, &g) == 0) {
+			for (i = 0; i < g.gl_pathc; i++) {
+				add(g.gl_pathv[i], strlen(g.gl_pathv[i]), "",
+					0, root, rootlen);
+			}
+
+			globfree(&g);
+		}
+
+		free(pat);
+	}
+}
+
+/* The request paths of a trace, which are ranked by how often they were
+ * requested. */
+static void
+fromtrace(const char *root, size_t rootlen, int vhosts)
+{
+	struct tracerec rec;
+	const char *p, *end, *dir;
+	char *host;
+	size_t dirlen, n;
+
+	end = list + listlen;
+
+	for (p = list + sizeof(TRACE_MAGIC) - 1; p < end;) {
+		if ((size_t)(end - p) < sizeof(rec)) {
+			break;
+		}
+
+		(void)memcpy(&rec, p, sizeof(rec));
+		p += sizeof(rec);
+
+		if ((size_t)(end - p) < (size_t)rec.pathlen + rec.hostlen) {
+			break;
+		}
+
+		dir = root;
+		dirlen = rootlen;
+
+		if (vhosts) {
+			if ((host = strndup(p + rec.pathlen, rec.hostlen))
+				== NULL) {
+				err(1, "warm: strndup");
+			}
+
+			dir = vhost(rec.hostlen != 0 ? host : NULL, &dirlen);
+			free(host);
+		}
+
+		/* The query doesn't name a different file. */
+		n = 0;
+		while (n < rec.pathlen && p[n] != '?') {
+			n++;
+		}
+
+		if (n > 0 && p[0] == '/') {
+			add(dir, dirlen, p, n, dir, dirlen);
+		}
+
+		p += rec.pathlen + rec.hostlen;
+	}
+}
+
+/* Add the path dir followed by path, joined as a request path is. */
+static void
+add(const char *dir, size_t dirlen, const char *path, size_t len,
+	const char *root, size_t rootlen)
+{
+	struct cand *c;
+	size_t n;
+
+	if (dirlen != 0 && dir[dirlen-1] == '/' && len > 0 && path[0] == '/') {
+		path++;
+		len--;
+	}
+
+	if (dirlen + len + 1 > PATH_MAX) {
+		return;
+	}
+
+	if (ncands == capcands) {
+		n = capcands != 0 ? 2 * capcands : 1024;
+
+		if ((c = reallocarray(cands, n, sizeof(*cands))) == NULL) {
+			err(1, "warm: reallocarray");
+		}
+
+		cands = c;
+		capcands = n;
+	}
+
+	c = &cands[ncands];
+
+	if ((c->path = malloc(dirlen + len + 1)) == NULL) {
+		err(1, "warm: malloc");
+	}
+
+	(void)memcpy(c->path, dir, dirlen);
+	(void)memcpy(c->path + dirlen, path, len);
+	c->path[dirlen + len] = '\0';
+	c->root = root;
+	c->rootlen = rootlen;
+	c->order = ncands++;
+	c->count = 1;
+}
+
+/* Merge repeated paths, then put the most requested first, and otherwise
+ * keep the order given, so the budget goes to the hottest files. */
+static void
+rank(void)
+{
+	size_t i, j;
+
+	if (ncands == 0) {
+		return;
+	}
+
+	qsort(cands, ncands, sizeof(*cands), pathcmp);
+
+	for (i = 1, j = 0; i < ncands; i++) {
+		if (strcmp(cands[i].path, cands[j].path) == 0) {
+			cands[j].count++;
+			free(cands[i].path);
+		} else {
+			cands[++j] = cands[i];
+		}
+	}
+
+	ncands = j + 1;
+
+	qsort(cands, ncands, sizeof(*cands), hotcmp);
+}
+
+static void *
+warmer(void *arg)
+{
+	struct cand *c;
+	uint64_t now;
+	size_t i;
+
+	(void)arg;
+
+	while (1) {
+		(void)pthread_mutex_lock(&lock);
+		c = next < ncands ? &cands[next++] : NULL;
+		(void)pthread_mutex_unlock(&lock);
+
+		if (c == NULL) {
+			return NULL;
+		}
+
+		warm(c);
+
+		(void)pthread_mutex_lock(&lock);
+
+		ndone++;
+		now = msec();
+
+		if (ndone == ncands || (ndone * STEPS / ncands
+			!= (ndone - 1) * STEPS / ncands && now - last >= QUIET)) {
+			last = now;
+			warnx("warm: %zu/%zu paths, %zu files read, %.1f MiB, "
+				"%zu locked, %.1f MiB, %zu missing, %.1f s", ndone,
+				ncands, nfiles, (double)nbytes / (1 << 20),
+				nlocked, (double)nlockbytes / (1 << 20), nmissing,
+				(double)(now - start) / 1e3);
+		}
+
+		/* Locked mappings outlive the list. */
+		if (ndone == ncands) {
+			for (i = 0; i < ncands; i++) {
+				free(cands[i].path);
+			}
+
+			free(cands);
+			cands = NULL;
+		}
+
+		(void)pthread_mutex_unlock(&lock);
+	}
+}
+
+/* Read the file at c into the page cache, and lock it if the budget allows. */
+static void
+warm(const struct cand *c)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	volatile const char *p;
+	size_t len, pages, i;
+	long pagesize;
+	void *m;
+	int fd, pin;
+
+	if (realpath(c->path, path) == NULL || stat(path, &st) == -1) {
+		goto missing;
+	}
+
+	/* Directories, and anything else requests can't get at, are left
+	 * alone, and aren't opened: a FIFO would wait for a writer. One swapped
+	 * in after the check doesn't either. */
+	if (memcmp(c->root, path, c->rootlen) != 0 || (c->root[c->rootlen-1]
+		!= '/' && path[c->rootlen] != '/' && path[c->rootlen] != '\0')
+		|| !S_ISREG(st.st_mode)) {
+		return;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK)) == -1) {
+		goto missing;
+	}
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0
+		|| (uintmax_t)st.st_size > SIZE_MAX) {
+		(void)close(fd);
+		return;
+	}
+
+	len = (size_t)st.st_size;
+	pagesize = sysconf(_SC_PAGESIZE);
+	pages = (len + (size_t)pagesize - 1) & ~((size_t)pagesize - 1);
+
+	(void)pthread_mutex_lock(&lock);
+	if ((pin = budget >= pages)) {
+		budget -= pages;
+	}
+	(void)pthread_mutex_unlock(&lock);
+
+	/* Locking reads the file in itself. */
+	if ((m = mmap(NULL, len, PROT_READ, MAP_SHARED | (pin ? 0
+		: MAP_POPULATE), fd, 0)) == MAP_FAILED) {
+		warn("warm: mmap %s", path);
+		(void)close(fd);
+		return;
+	}
+
+	(void)close(fd);
+
+	if (pin && mlock(m, len) == -1) {
+		warn("warm: mlock %s", path);
+		pin = 0;
+
+		(void)pthread_mutex_lock(&lock);
+		budget += pages;
+		(void)pthread_mutex_unlock(&lock);
+	}
+
+	if (!pin && MAP_POPULATE == 0) {
+		(void)posix_madvise(m, len, POSIX_MADV_WILLNEED);
+
+		for (p = m, i = 0; i < len; i += (size_t)pagesize) {
+			(void)p[i];
+		}
+	}
+
+	if (pin) {
+#ifdef MADV_DONTFORK
+		/* Bulk children have no use for it. */
+		(void)madvise(m, len, MADV_DONTFORK);
+#endif
+	} else {
+		(void)munmap(m, len);
+	}
+
+	(void)pthread_mutex_lock(&lock);
+	nfiles++;
+	nbytes += len;
+	if (pin) {
+		nlocked++;
+		nlockbytes += len;
+	}
+	(void)pthread_mutex_unlock(&lock);
+	return;
+
+missing:
+	if (errno != ENOENT && errno != ENOTDIR) {
+		warn("warm: %s", c->path);
+	}
+
+	(void)pthread_mutex_lock(&lock);
+	nmissing++;
+	(void)pthread_mutex_unlock(&lock);
+}
+
+static int
+pathcmp(const void *a, const void *b)
+{
+	const struct cand *x, *y;
+	int cmp;
+
+	x = a;
+	y = b;
+
+	if ((cmp = strcmp(x->path, y->path)) != 0) {
+		return cmp;
+	}
+
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int
+hotcmp(const void *a, const void *b)
+{
+	const struct cand *x, *y;
+
+	x = a;
+	y = b;
+
+	if (x->count != y->count) {
+		return x->count > y->count ? -1 : 1;
+	}
+
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static uint64_t
+msec(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
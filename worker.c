@@ -0,0 +1,468 @@
+/* Prefork workers, each with its own listening socket in one SO_REUSEPORT
+ * group. Worker i is pinned to the CPUs c with c % nworkers == i, and on
+ * Linux a classic BPF program on the group picks the socket for a new
+ * connection the same way from the CPU that received it, so connections are
+ * accepted next to the NIC queue that delivered them. The parent only keeps
+ * the index and restarts workers that die. */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* CPU_SET, sched_getcpu */
+#endif
+
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filesrv.h"
+
+#define NODE_DIR	"/sys/devices/system/node"
+
+struct stats {
+	uint64_t conns;
+	uint64_t steered;	/* received on one of the worker's CPUs */
+	uint64_t cpu;		/* received on the CPU that accepted it */
+	uint64_t node;		/* received on the same NUMA node */
+};
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats	stats;
+static sigset_t		omask;
+static const int *	fds;
+static pid_t *		pids;
+static int		nworkers;
+static int		self = -1;
+#ifdef __linux__
+static cpu_set_t	mine;
+static int		cpunode[CPU_SETSIZE];
+#endif
+
+static void	steer(void);
+static int	respawn(void);
+static pid_t	spawn(int);
+static void	reap(void);
+static void	stop(int);
+static void	pin(void);
+static void *	reporter(void *);
+#ifdef __linux__
+static void	cpulist(const char *, int);
+#endif
+
+/* Read the NUMA topology while /sys is still reachable. */
+void
+workerinit(void)
+{
+#ifdef __linux__
+	char path[PATH_MAX];
+	char buf[4096];
+	struct dirent *ent;
+	DIR *d;
+	FILE *f;
+	char *end;
+	long node;
+	int i;
+
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		cpunode[i] = -1;
+	}
+
+	if ((d = opendir(NODE_DIR)) == NULL) {
+		return;
+	}
+
+	while ((ent = readdir(d)) != NULL) {
+		if (strncmp(ent->d_name, "node", 4) != 0) {
+			continue;
+		}
+
+		node = strtol(ent->d_name + 4, &end, 10);
+
+		if (end == ent->d_name + 4 || *end != '\0' || node < 0
+			|| node > INT_MAX) {
+			continue;
+		}
+
+		(void)snprintf(path, sizeof(path), "%s/%s/cpulist", NODE_DIR,
+			ent->d_name);
+
+		if ((f = fopen(path, "re")) == NULL) {
+			continue;
+		}
+
+		if (fgets(buf, sizeof(buf), f) != NULL) {
+			cpulist(buf, (int)node);
+		}
+
+		(void)fclose(f);
+	}
+
+	(void)closedir(d);
+#endif
+}
+
+/* Fork a worker for each of the n listening sockets in lfds and supervise
+ * them. Returns only in a worker, with its socket. */
+int
+workers(const int *lfds, int n)
+{
+	struct timespec ts;
+	sigset_t set;
+	int fd, i, sig;
+
+	fds = lfds;
+	nworkers = n;
+
+	if ((pids = calloc((size_t)n, sizeof(*pids))) == NULL) {
+		err(1, "calloc");
+	}
+
+	for (i = 0; i < n; i++) {
+		pids[i] = -1;
+	}
+
+	steer();
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGCHLD);
+	(void)sigaddset(&set, SIGHUP);
+	(void)sigaddset(&set, SIGINT);
+	(void)sigaddset(&set, SIGTERM);
+	(void)sigaddset(&set, SIGUSR1);
+	(void)sigaddset(&set, SIGUSR2);
+
+	/* Blocked before the index threads start, so they inherit it. */
+	if ((errno = pthread_sigmask(SIG_BLOCK, &set, &omask)) != 0) {
+		err(1, "pthread_sigmask");
+	}
+
+	if ((fd = respawn()) != -1) {
+		return fd;
+	}
+
+	/* Workers only read the index; the parent keeps it current. */
+	indexwatch();
+
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+
+	while (1) {
+		if ((sig = sigtimedwait(&set, NULL, &ts)) == -1) {
+			/* Dead workers are restarted once things have been
+			 * quiet for a second, so one dying at startup doesn't
+			 * spin. */
+			if (errno == EAGAIN && (fd = respawn()) != -1) {
+				return fd;
+			}
+			continue;
+		}
+
+		switch (sig) {
+		case SIGCHLD:
+			reap();
+			break;
+		case SIGUSR1:
+			/* Profiles are taken of one worker at a time. */
+			break;
+		case SIGUSR2:
+			for (i = 0; i < n; i++) {
+				if (pids[i] != -1) {
+					(void)kill(pids[i], SIGUSR2);
+				}
+			}
+			break;
+		default:
+			stop(sig);
+		}
+	}
+}
+
+/* Count how local a connection accepted by a worker is. */
+void
+workerconn(int afd)
+{
+#ifdef __linux__
+	socklen_t len;
+	int cpu, in;
+
+	len = sizeof(in);
+
+	if (self == -1 || getsockopt(afd, SOL_SOCKET, SO_INCOMING_CPU, &in,
+		&len) == -1) {
+		return;
+	}
+
+	cpu = sched_getcpu();
+
+	(void)pthread_mutex_lock(&lock);
+
+	stats.conns++;
+
+	if (in >= 0 && in < CPU_SETSIZE) {
+		if (CPU_ISSET((size_t)in, &mine)) {
+			stats.steered++;
+		}
+
+		if (in == cpu) {
+			stats.cpu++;
+		}
+
+		if (cpu >= 0 && cpu < CPU_SETSIZE && cpunode[in] != -1
+			&& cpunode[in] == cpunode[cpu]) {
+			stats.node++;
+		}
+	}
+
+	(void)pthread_mutex_unlock(&lock);
+#else
+	(void)afd;
+#endif
+}
+
+static void
+steer(void)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	struct sock_filter code[] = {
+		/* A = CPU that received the packet. */
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			(uint32_t)(SKF_AD_OFF + SKF_AD_CPU)),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)nworkers),
+		/* Sockets are numbered in the order they started listening. */
+		BPF_STMT(BPF_RET | BPF_A, 0)
+	};
+	struct sock_fprog prog;
+
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+
+	if (setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+		sizeof(prog)) == -1) {
+		warn("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+	}
+#else
+	warnx("SO_ATTACH_REUSEPORT_CBPF not supported");
+#endif
+}
+
+/* Start the workers that aren't running. Returns the socket in a new worker,
+ * -1 in the parent. */
+static int
+respawn(void)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (pids[i] == -1 && (pids[i] = spawn(i)) == 0) {
+			return fds[i];
+		}
+	}
+
+	return -1;
+}
+
+static pid_t
+spawn(int i)
+{
+	pthread_t t;
+	sigset_t set;
+	pid_t pid;
+	int j;
+
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		return -1;
+	}
+
+	if (pid > 0) {
+		return pid;
+	}
+
+	self = i;
+
+	for (j = 0; j < nworkers; j++) {
+		if (j != i) {
+			(void)close(fds[j]);
+		}
+	}
+
+	/* Pinned before the worker touches its buffers, so first-touch
+	 * allocation places them on its own node. */
+	pin();
+
+	/* SIGUSR1 is left to the profiler's thread, if any. */
+	set = omask;
+	(void)sigaddset(&set, SIGUSR1);
+	(void)sigaddset(&set, SIGUSR2);
+
+	if ((errno = pthread_sigmask(SIG_SETMASK, &set, NULL)) != 0) {
+		err(1, "pthread_sigmask");
+	}
+
+	if ((errno = pthread_create(&t, NULL, reporter, NULL)) != 0) {
+		err(1, "pthread_create");
+	}
+
+	(void)pthread_detach(t);
+
+	return 0;
+}
+
+static void
+reap(void)
+{
+	pid_t pid;
+	int i, status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < nworkers; i++) {
+			if (pids[i] != pid) {
+				continue;
+			}
+
+			if (WIFSIGNALED(status)) {
+				warnx("worker %d killed by signal %d", i,
+					WTERMSIG(status));
+			} else {
+				warnx("worker %d exited with status %d", i,
+					WEXITSTATUS(status));
+			}
+
+			pids[i] = -1;
+		}
+	}
+}
+
+/* Take the workers down with the parent. */
+static void
+stop(int sig)
+{
+	sigset_t set;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (pids[i] != -1) {
+			(void)kill(pids[i], sig);
+		}
+	}
+
+	(void)signal(sig, SIG_DFL);
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, sig);
+	(void)pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+	(void)raise(sig);
+
+	exit(1);
+}
+
+static void
+pin(void)
+{
+#ifdef __linux__
+	cpu_set_t all;
+	int c;
+
+	CPU_ZERO(&mine);
+
+	if (sched_getaffinity(0, sizeof(all), &all) == -1) {
+		warn("sched_getaffinity");
+		return;
+	}
+
+	for (c = 0; c < CPU_SETSIZE; c++) {
+		if (CPU_ISSET((size_t)c, &all) && c % nworkers == self) {
+			CPU_SET((size_t)c, &mine);
+		}
+	}
+
+	/* More workers than CPUs: the extra ones get no steered traffic. */
+	if (CPU_COUNT(&mine) == 0) {
+		return;
+	}
+
+	if (sched_setaffinity(0, sizeof(mine), &mine) == -1) {
+		warn("sched_setaffinity");
+	}
+#endif
+}
+
+/* Log the locality counters on SIGUSR2. */
+static void *
+reporter(void *arg)
+{
+	struct stats s;
+	sigset_t set;
+	int sig;
+
+	(void)arg;
+
+	(void)sigemptyset(&set);
+	(void)sigaddset(&set, SIGUSR2);
+
+	while (1) {
+		if (sigwait(&set, &sig) != 0) {
+			continue;
+		}
+
+		(void)pthread_mutex_lock(&lock);
+		s = stats;
+		(void)pthread_mutex_unlock(&lock);
+
+		warnx("worker %d: %ju connections, %ju steered, %ju same cpu, "
+			"%ju same node", self, (uintmax_t)s.conns,
+			(uintmax_t)s.steered, (uintmax_t)s.cpu,
+			(uintmax_t)s.node);
+		offloadlog();
+	}
+
+	return NULL;
+}
+
+#ifdef __linux__
+/* Parse a cpulist such as "0-3,8-11". */
+static void
+cpulist(const char *s, int node)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	while (*s != '\0' && *s != '\n') {
+		lo = strtoul(s, &end, 10);
+
+		if (end == s) {
+			return;
+		}
+
+		hi = lo;
+
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtoul(s, &end, 10);
+
+			if (end == s) {
+				return;
+			}
+		}
+
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++) {
+			cpunode[lo] = node;
+		}
+
+		s = *end == ',' ? end + 1 : end;
+	}
+}
+#endif